@@ -4,4 +4,6 @@
 unsigned short default_port = 64697;
 
 // Exit codes
-int CONNECTION_COULD_NOT_BE_ESTABLISHED{1};
\ No newline at end of file
+int CONNECTION_COULD_NOT_BE_ESTABLISHED{1};
+int LOCAL_SYNC_INCOMPLETE{8};
+int SYNC_INCOMPLETE{9};
\ No newline at end of file
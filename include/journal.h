@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+
+#include <fcntl.h>
+
+#include "dir_sync.pb.h"
+
+using std::string;
+
+using dir_sync::FileTree;
+using dir_sync::JournalRecord;
+
+// Holds the id of a sync root and its journals, never synced itself
+const char JOURNAL_DIRECTORY[]{".dir_sync"};
+
+// Random id of the sync root at root_fd, created on first use. Empty if it 
+// can't be stored.
+string local_peer_id(int root_fd=AT_FDCWD);
+
+// Ids end up in file names, only hex digits are accepted
+bool valid_peer_id(const string& peer_id);
+
+// Durable record of the last tree two peers agreed on, one per peer. A 
+// reconnecting client only has to send what changed since then.
+class SyncJournal {
+public:
+	// Journals live in JOURNAL_DIRECTORY of the sync root at root_fd
+	explicit SyncJournal(int root_fd=AT_FDCWD);
+
+	// False if nothing has been journaled for the peer
+	bool load(const string& peer_id, JournalRecord& record) const;
+
+	// The previous record is replaced once the new one is on disk
+	bool store(const JournalRecord& record) const;
+
+private:
+	string path(const string& peer_id) const;
+
+	int root_fd_;
+};
+
+// Entries of tree that are new or differ from base, entries missing from 
+// tree are listed as removed. If given, digest is turned from base's 
+// tree_digest() into tree's.
+FileTree tree_delta(const FileTree& base, const FileTree& tree, 
+	string* digest=nullptr);
+
+// Inverse of tree_delta(), digest is updated the same way
+FileTree apply_tree_delta(const FileTree& base, const FileTree& delta, 
+	string* digest=nullptr);
+
+// Digest of the entries of a tree regardless of their order. Entries are 
+// hashed one by one and summed up, deltas only touch the entries they change.
+string tree_digest(const FileTree& tree);
+
+// Stored digest of the record's tree, computed for records without one
+string record_digest(const JournalRecord& record);
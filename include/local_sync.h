@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+#include "path_filter.h"
+
+using std::string;
+
+const unsigned int DEFAULT_LOCAL_WORKERS{4};
+
+struct local_sync_options {
+	PathFilter filter{};
+	// Files copied in parallel
+	unsigned int workers{DEFAULT_LOCAL_WORKERS};
+	// Hashes every file instead of comparing size and mtime
+	bool strict{false};
+	// Only logs what would be created and copied
+	bool dry_run{false};
+};
+
+struct local_sync_result {
+	unsigned long long directories{0};
+	unsigned long long files{0};
+	unsigned long long bytes{0};
+	unsigned long long failed{0};
+};
+
+// Syncs two directories on the same host like a session between a server
+// (first) and a client (second) would: missing entries are created on
+// either side, differing files are replaced by the newer one. There are no
+// sockets or messages involved, files are reflinked or copied in the kernel
+// by parallel workers. False if either directory can't be opened.
+bool sync_local(const string& first, const string& second,
+	const local_sync_options& options, local_sync_result& result);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <array>
+#include <functional>
+
+#include "networking.h"
+
+using std::string;
+using std::array;
+using std::function;
+
+// Handlers return ROUTE_NEXT to keep routing, PROTO_TYPE_STAGE_END to end
+// the stage or an error code
+const int ROUTE_NEXT{0};
+
+// Dispatches frames of any type to the handler registered for it. The
+// handler table is indexed by MessageType, there are no type_info or hash
+// lookups. Messages may arrive in any order and interleaved, handlers keep
+// whatever state they need between them.
+class MessageRouter {
+public:
+	// handler is called with the parsed message, or with the message and
+	// the data that followed it (zero copy sends). Registering a type again
+	// replaces its handler.
+	template <typename T, typename F>
+	void on(F handler) {
+		handlers_[index(message_traits<T>::type())] =
+			[handler, message = T()](const string& serialized_message,
+				string& raw) mutable {
+				if (!message.ParseFromString(serialized_message)) {
+					return PROTO_TYPE_WRONG;
+				}
+
+				return invoke(handler, message, raw, 0);
+			};
+	}
+
+	// Without a handler, separators end the stage and other types are
+	// PROTO_TYPE_WRONG
+	int dispatch(MessageType type, const string& serialized_message,
+		string& raw);
+
+private:
+	typedef function<int(const string&, string&)> route_handler;
+
+	static unsigned int index(MessageType type) {
+		return static_cast<unsigned int>(type);
+	}
+
+	// Picks the two-argument form if the handler accepts it
+	template <typename F, typename T>
+	static auto invoke(F& handler, T& message, string& raw, int) ->
+		decltype(handler(message, raw)) {
+		return handler(message, raw);
+	}
+
+	template <typename F, typename T>
+	static int invoke(F& handler, T& message, string&, long) {
+		return handler(message);
+	}
+
+	array<route_handler, MESSAGE_TYPE_COUNT> handlers_;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "asio.hpp"
+
+#include <google/protobuf/message.h>
+
+#include "networking.h"
+#include "message_router.h"
+
+using std::string;
+using std::deque;
+using std::mutex;
+using std::condition_variable;
+
+using asio::ip::tcp;
+
+using google::protobuf::Message;
+
+// Logical streams of a session. Each has its own stage separators, frames 
+// of different streams are interleaved on the wire.
+enum class Stream {
+	// File tree, directory and file requests
+	Control = 0,
+	// File metadata and parts
+	Files = 1,
+	// Parts that failed verification ...
+	ChunkRequests = 2,
+	// ... and their replacements
+	Repairs = 3
+};
+
+const unsigned int STREAM_COUNT{4};
+
+// Raw data following a message is at most one file part (bytes)
+const unsigned long long MAX_RAW_SIZE{16 * 1024 * 1024};
+// Frames queued for a stream before the socket isn't read any further, 
+// until its receiver catches up (bytes)
+const unsigned long long MAX_QUEUED_BYTES{16 * 1024 * 1024};
+
+// Frame as it is queued for the receiver of its stream
+struct mux_frame {
+	MessageType type;
+	string message;
+	// Data that followed the message (zero copy sends)
+	string raw;
+};
+
+// Runs the streams of a session over one connection in both directions at 
+// once. Frames are written whole, so concurrent senders interleave frame 
+// by frame. There is no reader thread: a receiver that has to wait reads 
+// from the socket itself and queues frames of other streams for their 
+// receivers. Once a stream has MAX_QUEUED_BYTES queued reading pauses 
+// until its receiver catches up, the peer is slowed down by TCP.
+class Multiplexer {
+public:
+	explicit Multiplexer(tcp::socket& sock);
+
+	// Frames are read from read_sock (see TlsSession::reader())
+	Multiplexer(tcp::socket& sock, tcp::socket& read_sock);
+
+	template <typename T>
+	int send(Stream stream, const T& message) {
+		return send_serialized(stream, serialize_proto(message));
+	}
+
+	// Frame built by serialize_proto()
+	int send_serialized(Stream stream, const string& serialized_message);
+
+	// length bytes of fd follow the message without being copied through 
+	// userspace
+	template <typename T>
+	int send_zero_copy(Stream stream, const T& message, int fd, 
+		long long offset, size_t length) {
+		return send_serialized_zero_copy(stream, serialize_proto(message), fd, 
+			offset, length);
+	}
+
+	int send_serialized_zero_copy(Stream stream, 
+		const string& serialized_message, int fd, long long offset, 
+		size_t length);
+
+	// Same results as recv_proto(), messages of other types are dropped
+	template <typename T>
+	int recv(Stream stream, T& message) {
+		string raw;
+
+		return recv(stream, message_traits<T>::type(), message, raw);
+	}
+
+	// raw receives the data that followed the message
+	template <typename T>
+	int recv(Stream stream, T& message, string& raw) {
+		return recv(stream, message_traits<T>::type(), message, raw);
+	}
+
+	int recv(Stream stream, MessageType type, Message& message, string& raw);
+
+	// Hands every frame of the stream to the router, in the order they 
+	// arrive, until a handler ends the stage or fails
+	int route(Stream stream, MessageRouter& router);
+
+	// Fails every receiver and the connection, for a side that gives up 
+	// while others wait
+	void shutdown();
+
+private:
+	// Waits for the next frame of the stream
+	int next_frame(Stream stream, mux_frame& frame);
+
+	int write_frame(Stream stream, const string& serialized_message, 
+		u_int64_t raw_size);
+
+	int read_frame(unsigned int& stream_index, mux_frame& frame);
+
+	// Another stream than this one has its fill of frames queued
+	bool backlogged(Stream stream) const;
+
+	tcp::socket& sock_;
+	tcp::socket& read_sock_;
+
+	mutex send_mtx_;
+
+	mutex recv_mtx_;
+	condition_variable frame_queued_;
+	deque<mux_frame> queues_[STREAM_COUNT];
+	unsigned long long queued_bytes_[STREAM_COUNT]{};
+	// A receiver is reading from the socket
+	bool reading_{false};
+	bool closed_{false};
+};
+
+int send_protocol_separator(Multiplexer& mux, Stream stream);
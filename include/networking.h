@@ -1,7 +1,6 @@
 #pragma once
 
-#include <unordered_map>
-#include <typeindex>
+#include <string>
 
 #include "asio.hpp"
 
@@ -9,8 +8,7 @@
 
 #include "dir_sync.pb.h"
 
-using std::unordered_map;
-using std::type_index;
+using std::string;
 
 using asio::ip::tcp;
 
@@ -23,6 +21,10 @@ using dir_sync::DirectoryRequest;
 using dir_sync::SanityCheck;
 using dir_sync::ProtocolSeparator;
 using dir_sync::MinimalFileMetadata;
+using dir_sync::ChunkRequest;
+using dir_sync::LinkProbe;
+using dir_sync::SyncGeneration;
+using dir_sync::FileHash;
 
 enum class MessageType {
 	FileTree = 1,
@@ -31,18 +33,39 @@ enum class MessageType {
 	DirectoryRequest = 4,
 	SanityCheck = 5,
 	ProtocolSeparator = 6,
-	MinimalFileMetadata = 7
+	MinimalFileMetadata = 7,
+	ChunkRequest = 8,
+	LinkProbe = 9,
+	SyncGeneration = 10,
+	FileHash = 11
 };
 
-const unordered_map<type_index, MessageType> proto_type_mapping {
-	{typeid(FileTree), MessageType::FileTree},
-	{typeid(FileRequest), MessageType::FileRequest},
-	{typeid(FileResponse), MessageType::FileResponse},
-	{typeid(DirectoryRequest), MessageType::DirectoryRequest},
-	{typeid(SanityCheck), MessageType::SanityCheck},
-	{typeid(ProtocolSeparator), MessageType::ProtocolSeparator},
-	{typeid(MinimalFileMetadata), MessageType::MinimalFileMetadata}
-};
+// Highest MessageType plus one, sizes tables indexed by type
+const unsigned int MESSAGE_TYPE_COUNT{12};
+
+// Wire type of a message, resolved at compile time
+template <typename T>
+struct message_traits;
+
+#define MESSAGE_TRAITS(name) \
+	template <> \
+	struct message_traits<name> { \
+		static constexpr MessageType type() { return MessageType::name; } \
+	};
+
+MESSAGE_TRAITS(FileTree)
+MESSAGE_TRAITS(FileRequest)
+MESSAGE_TRAITS(FileResponse)
+MESSAGE_TRAITS(DirectoryRequest)
+MESSAGE_TRAITS(SanityCheck)
+MESSAGE_TRAITS(ProtocolSeparator)
+MESSAGE_TRAITS(MinimalFileMetadata)
+MESSAGE_TRAITS(ChunkRequest)
+MESSAGE_TRAITS(LinkProbe)
+MESSAGE_TRAITS(SyncGeneration)
+MESSAGE_TRAITS(FileHash)
+
+#undef MESSAGE_TRAITS
 
 const unsigned int U_INT_8_SIZE{sizeof(u_int8_t)};
 const unsigned int U_INT_64_SIZE{sizeof(u_int64_t)};
@@ -56,6 +79,86 @@ const int PROTO_TYPE_WRONG{1};
 
 const int ASIO_ERROR{2};
 
-int send_proto(tcp::socket& sock, Message& message);
+const int PROBE_OK{0};
+
+// Larger messages are refused, a corrupt or hostile size would be 
+// allocated otherwise (bytes)
+const unsigned long long MAX_MESSAGE_SIZE{1ULL << 30};
+
+// Payload of each probe sent while throughput is measured
+const unsigned int LINK_PROBE_SIZE{65536};
+// Probes are sent back to back for this many round trips ...
+const unsigned int LINK_PROBE_RTTS{4};
+// ... but at least and at most this long (seconds)
+const double MIN_LINK_PROBE_TIME{0.01};
+const double MAX_LINK_PROBE_TIME{0.25};
+// Upper bound for socket buffers sized to the bandwidth-delay product
+const int MAX_SOCKET_BUFFER{64 * 1024 * 1024};
+
+struct link_estimate {
+	// Seconds
+	double rtt;
+	// Bytes per second
+	double throughput;
+};
+
+// Header and payload of a message, ready to be written to a socket
+string serialize_proto(MessageType type, const Message& message);
+
+template <typename T>
+string serialize_proto(const T& message) {
+	return serialize_proto(message_traits<T>::type(), message);
+}
+
+int send_serialized(tcp::socket& sock, const string& serialized_message);
+
+int send_proto(tcp::socket& sock, MessageType type, const Message& message);
+
+template <typename T>
+int send_proto(tcp::socket& sock, const T& message) {
+	return send_proto(sock, message_traits<T>::type(), message);
+}
+
+// Reads the next message whatever its type. Messages over MAX_MESSAGE_SIZE 
+// are refused, the connection is out of sync then.
+int recv_frame(tcp::socket& sock, MessageType& type, string& message);
+
+// Parses the next message if it has the expected type. Returns 
+// PROTO_TYPE_STAGE_END for separators and PROTO_TYPE_WRONG for anything 
+// else, the message is consumed either way.
+int recv_proto(tcp::socket& sock, MessageType type, Message& message);
+
+template <typename T>
+int recv_proto(tcp::socket& sock, T& message) {
+	return recv_proto(sock, message_traits<T>::type(), message);
+}
+
+// Writes a range of a file to the socket without copying it through 
+// userspace (sendfile() where available)
+int send_file_range(tcp::socket& sock, int fd, long long offset, 
+	size_t length);
+
+// Server side of the handshake: RTT is measured with an empty probe, 
+// throughput by sending probes back to back for a few round trips. The 
+// kernel's estimates of the connection (tcp_fd) are preferred where they 
+// are available. The result is sent to the client. Answers are read from 
+// read_sock (see TlsSession::reader()).
+int probe_link(tcp::socket& sock, tcp::socket& read_sock, int tcp_fd, 
+	link_estimate& link);
+
+int probe_link(tcp::socket& sock, link_estimate& link);
+
+// Client side of the handshake
+int answer_link_probes(tcp::socket& sock, tcp::socket& read_sock, 
+	link_estimate& link);
+
+int answer_link_probes(tcp::socket& sock, link_estimate& link);
+
+// Disables Nagle's algorithm (messages are written in one piece anyway) 
+// and grows socket buffers to twice the bandwidth-delay product. fd is the 
+// TCP connection (see TlsSession::network_fd()).
+void tune_socket(int fd, const link_estimate& link);
 
-int recv_proto(tcp::socket& sock, Message& message);
\ No newline at end of file
+// Coalesces small messages into full segments while enabled, disabling it 
+// flushes pending data. No-op where TCP_CORK is not available.
+void set_cork(int fd, bool cork);
\ No newline at end of file
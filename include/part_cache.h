@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+using std::string;
+using std::list;
+using std::shared_ptr;
+using std::mutex;
+using std::unordered_map;
+
+// Default memory budget of the serialized part cache (in bytes)
+const unsigned long long DEFAULT_PART_CACHE_SIZE{256ULL * 1024 * 1024};
+
+// Bounded LRU cache of serialized FileResponse messages shared by all 
+// sessions of a server. Part sizes depend on the link of a session, the 
+// length of a part is therefore part of its key. Entries are reference 
+// counted, evicting a part that is still being sent is therefore safe.
+class PartCache {
+public:
+	explicit PartCache(unsigned long long capacity);
+
+	// Returns nullptr if the part is not cached
+	shared_ptr<const string> get(const string& relative_path, 
+		const string& hash, unsigned long long offset, 
+		unsigned long long length);
+
+	void put(const string& relative_path, const string& hash, 
+		unsigned long long offset, unsigned long long length, 
+		shared_ptr<const string> serialized_part);
+
+	unsigned long long size();
+
+private:
+	typedef list<string> lru_list;
+
+	struct entry {
+		shared_ptr<const string> serialized_part;
+		lru_list::iterator lru_position;
+	};
+
+	void evict();
+
+	unsigned long long capacity_;
+	unsigned long long size_{0};
+
+	// Most recently used key at the front
+	lru_list lru_;
+	unordered_map<string, entry> entries_;
+
+	mutex mtx_;
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+using std::string;
+using std::vector;
+using std::unordered_map;
+
+// Set of gitignore-style exclude rules, compiled once and queried for 
+// every scanned path:
+//   - the last matching rule wins, rules prefixed with '!' re-include paths
+//   - rules with a trailing '/' only match directories
+//   - rules containing a '/' are anchored to the sync directory, all 
+//     others match the name of a file or directory at any depth
+//   - '*' and '?' don't match '/', '**' does, '[...]' matches a character 
+//     class
+// Rules without wildcards (".git/", "node_modules") are looked up in hash 
+// tables, only glob rules are matched one by one.
+class PathFilter {
+public:
+	void add_rule(string rule);
+
+	bool empty() const;
+
+	// Only considers the path itself, parent directories are assumed to 
+	// have been checked already (e.g. during traversal)
+	bool excluded(const string& relative_path, bool is_directory) const;
+
+	// Also considers all parent directories
+	bool excluded_recursive(const string& relative_path, 
+		bool is_directory) const;
+
+private:
+	struct rule {
+		string pattern;
+		bool negated;
+		bool directory_only;
+		// Matched against the whole relative path instead of the name
+		bool anchored;
+	};
+
+	// Index of the last rule matching the path, -1 if none does
+	long long match_literals(const unordered_map<string, vector<size_t>>& 
+		literals, const string& key, bool is_directory) const;
+
+	vector<rule> rules_;
+
+	// Literal pattern -> indices of rules (ascending)
+	unordered_map<string, vector<size_t>> name_literals_;
+	unordered_map<string, vector<size_t>> path_literals_;
+	// Indices of rules that need glob matching (ascending)
+	vector<size_t> globs_;
+};
+
+bool glob_match(const char* pattern, const char* text);
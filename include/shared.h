@@ -2,32 +2,92 @@
 
 #include <string>
 #include <vector>
+#include <unordered_set>
+#include <chrono>
+
+#include <fcntl.h>
 
 #include "asio.hpp"
 
 #include "dir_sync.pb.h"
 
+#include "part_cache.h"
+#include "path_filter.h"
+#include "networking.h"
+#include "multiplexer.h"
+#include "write_pool.h"
+
 using std::string;
 using std::vector;
+using std::unordered_set;
+
+using std::chrono::steady_clock;
 
 using asio::ip::tcp;
 
 using dir_sync::FileTree;
 using dir_sync::SanityCheck;
 
-// Max amount of file descriptors nftw() is allowed to use
-const unsigned short MAX_FDS{15};
+// Default, parts are resized to the link of a session (see tuned_part_size)
 const unsigned int PART_SIZE{65536};
+const unsigned int MIN_PART_SIZE{16384};
+const unsigned int MAX_PART_SIZE{4194304};
+// Parts are sized to occupy the link for roughly this long (seconds)
+const double TARGET_PART_TIME{0.002};
+// Parts are re-tuned to the kernel's estimate of the link this often while 
+// files are sent (seconds)
+const double PART_RETUNE_INTERVAL{0.1};
+// Favours speed, compression has to keep up with the link
+const int COMPRESSION_LEVEL{1};
 
 const int FILE_RECV_OK{0};
 const int FILE_SEND_OK{0};
 const int DIRECTORY_SEND_OK{0};
 const int PROTO_SEPARATOR_SEND_OK{0};
 const int SEND_MTIME_ERR{3};
+const int FILE_READ_ERR{4};
+const int CHUNK_REPAIR_OK{0};
 
+struct file_extent {
+	long long offset;
+	long long length;
+};
+
+// Regions of a file that contain data, holes are left out. Falls back to
+// a single extent if holes can't be detected.
+vector<file_extent> data_extents(int fd, long long size);
+
+// Holes are hashed as zeros without being read
 string sha512_hash_file(int fd, long long size);
 
-FileTree get_file_tree(string path);
+// Raw (binary) SHA-512 digest
+string sha512_digest(const char* data, size_t size);
+
+string sha512_digest(const string& data);
+
+// Directory descriptors a scan holds open at once, deeper directories are 
+// walked afterwards, opened by path from the root
+const unsigned short MAX_FDS{15};
+
+// Excluded directories are pruned, they are neither traversed nor hashed. 
+// Files are only hashed by a strict scan, otherwise size and mtime are 
+// collected without opening them.
+FileTree get_file_tree(string path, const PathFilter& filter=PathFilter(), 
+	bool strict=true);
+
+// Scans the directory at root_fd, the descriptor stays open
+FileTree get_file_tree(int root_fd, const PathFilter& filter=PathFilter(), 
+	bool strict=true);
+
+// Empty if the file can't be read
+string hash_file(const string& relative_path, int root_fd=AT_FDCWD);
+
+// Hashes the listed files of a quick checked tree that have no hash yet
+void hash_files(FileTree& file_tree, const vector<string>& relative_paths, 
+	int root_fd=AT_FDCWD);
+
+// Removes excluded entries from a tree that has been scanned elsewhere
+void filter_file_tree(FileTree& file_tree, const PathFilter& filter);
 
 SanityCheck run_sanity_check();
 
@@ -37,12 +97,105 @@ string repr_chdir_error(int error_code);
 
 void print_string_vector(vector<string> vec, bool verbose=false);
 
-int send_file(tcp::socket& sock, string relative_path);
+// Relative paths are resolved against root_fd, the working directory by 
+// default. The same goes for the file functions below.
+bool set_mtime(time_t mtime, string path, int root_fd=AT_FDCWD);
+
+bool compress_part(const string& raw, string& compressed);
+
+bool decompress_part(const string& compressed, unsigned long long raw_size, 
+	string& raw);
+
+// Paths received from the peer have to stay below the sync root: relative 
+// and without ".." components
+bool safe_relative_path(const string& path);
+
+// Appended to the destination of a copy in progress, such files are never 
+// part of a tree
+const char TEMPORARY_SUFFIX[]{".dir_sync.tmp"};
+
+// Reflinks the file if possible, otherwise copies its data extents with 
+// copy_file_range() (holes are kept). The copy is synced to disk and 
+// renamed over the destination, which is left alone on failure.
+bool copy_local_file(string source_path, string destination_path, 
+	int root_fd=AT_FDCWD);
+
+// Power of two between MIN_PART_SIZE and MAX_PART_SIZE
+unsigned int tuned_part_size(const link_estimate& link);
+
+// Part size of a session that follows the link. The kernel's estimate of 
+// the connection (TCP_INFO) is read every PART_RETUNE_INTERVAL, socket 
+// buffers grow along with it. Only used by the sending thread.
+class PartSizer {
+public:
+	// A negative tcp_fd keeps the size of the initial estimate
+	PartSizer(int tcp_fd, const link_estimate& link);
+
+	// Size of the next part
+	unsigned int next();
+
+	// Largest size handed out so far
+	unsigned int largest() const { return largest_; }
+
+private:
+	int tcp_fd_;
+	link_estimate link_;
+	unsigned int part_size_;
+	unsigned int largest_;
+	steady_clock::time_point next_update_;
+};
+
+struct send_options {
+	// Parts are served from (and added to) the cache if one is supplied. 
+	// They are keyed by the size and mtime of the file when it's sent, 
+	// along with its content hash if there is one.
+	PartCache* part_cache{nullptr};
+	// Also handed to the receiver for verification
+	string hash{};
+	bool compress{false};
+	unsigned int part_size{PART_SIZE};
+	// File data bypasses userspace (and the cache), only when uncompressed
+	bool zero_copy{false};
+	// Sync root that relative_path is resolved against
+	int root_fd{AT_FDCWD};
+	// Replaces part_size while the file is sent if supplied
+	PartSizer* part_sizer{nullptr};
+};
+
+// Metadata and parts go out on the Files stream
+int send_file(Multiplexer& mux, string relative_path, 
+	const send_options& options=send_options());
+
+// Instructs the receiver to copy an identical local file instead
+int send_file_copy(Multiplexer& mux, string relative_path, 
+	string source_path, time_t mtime);
 
 // 'Send' means request in this context
 // Little counter-intuitive but naming things is hard 
-int send_directory(tcp::socket& sock, string relative_path);
-
-int recv_files(tcp::socket& sock);
-
-int send_protocol_separator(tcp::socket& sock);
\ No newline at end of file
+int send_directory(Multiplexer& mux, string relative_path);
+
+struct recv_options {
+	// Sync root that received paths are resolved against
+	int root_fd{AT_FDCWD};
+	// Files are written by this many threads while the calling thread 
+	// keeps receiving
+	unsigned int writers{DEFAULT_WRITERS};
+	// Parts received but not written yet are held up to this many bytes
+	unsigned long long write_buffer_size{DEFAULT_WRITE_BUFFER_SIZE};
+	// Files may be sent as copies of another file of the receiver
+	bool allow_copies{true};
+	// Only these files are accepted if set
+	const unordered_set<string>* expected_paths{nullptr};
+};
+
+// Files with unsafe or unexpected paths end the session. Parts that fail 
+// verification are re-requested on the ChunkRequests 
+// stream once all files have been received, the sender has to answer with 
+// serve_chunk_requests()
+int recv_files(Multiplexer& mux, const recv_options& options=recv_options());
+
+// Replacement parts go out on the Repairs stream. Only parts of the files 
+// sent in the session (sent_paths) are served, none longer than part_size.
+int serve_chunk_requests(Multiplexer& mux, 
+	const unordered_set<string>& sent_paths, unsigned int part_size, 
+	int root_fd=AT_FDCWD);
\ No newline at end of file
@@ -0,0 +1,20 @@
+#pragma once
+
+// Kernel's view of a TCP connection
+struct tcp_link_info {
+	// Smoothed round trip time (seconds)
+	double rtt;
+	// Most recent delivery rate (bytes per second), 0 if unknown
+	double delivery_rate;
+	// The sender ran out of data while the rate was measured, it's a lower 
+	// bound then
+	bool app_limited;
+	// Payload bytes the peer acknowledged and payload bytes received over 
+	// the lifetime of the connection, 0 if unknown
+	unsigned long long bytes_acked;
+	unsigned long long bytes_received;
+};
+
+// False where TCP_INFO isn't available. Lives in its own translation unit, 
+// the kernel's header clashes with the libc one asio pulls in.
+bool read_tcp_info(int fd, tcp_link_info& info);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <memory>
+
+#include "asio.hpp"
+
+#include <openssl/ssl.h>
+
+using std::string;
+using std::thread;
+using std::unique_ptr;
+
+using asio::ip::tcp;
+
+const int TLS_OK{0};
+const int TLS_CONTEXT_ERR{6};
+const int TLS_HANDSHAKE_ERR{7};
+
+// Sessions of a context with kernel set hand their record layer to the 
+// kernel where possible (see TlsSession), otherwise it stays in userspace
+
+SSL_CTX* create_tls_server_context(string certificate_path, string key_path, 
+	bool kernel=true);
+
+// The system's default CA paths are used if ca_path is empty
+SSL_CTX* create_tls_client_context(string ca_path, bool kernel=true);
+
+// TLS layer of a connection. After the handshake the record layer is 
+// handed to the kernel (kTLS) where possible: the socket can then be used 
+// like a plaintext one, including sendfile(). Kernels that only offload 
+// sending keep writing to the socket, received records are decrypted by a 
+// userspace thread and read from reader(). Otherwise a userspace proxy 
+// thread relays between the TLS connection and a socket pair whose other 
+// end replaces the socket. The socket has to be closed before the session 
+// is destroyed.
+class TlsSession {
+public:
+	TlsSession() = default;
+	TlsSession(const TlsSession&) = delete;
+	TlsSession& operator=(const TlsSession&) = delete;
+	~TlsSession();
+
+	// peer_address is verified against the peer's certificate if not empty
+	int start(tcp::socket& sock, SSL_CTX* ctx, bool server, 
+		string peer_address="");
+
+	// Encryption is handled by the kernel
+	bool kernel() const;
+
+	// Data written to the socket is encrypted by the kernel, files can be 
+	// sent without copying them
+	bool kernel_send() const;
+
+	// Socket received data is read from, sock itself unless only sending is 
+	// offloaded
+	tcp::socket& reader(tcp::socket& sock);
+
+	// Descriptor of the TCP connection, for socket options
+	int network_fd(tcp::socket& sock) const;
+
+private:
+	void relay();
+
+	// Decrypts received records for reader() while the kernel sends
+	void relay_received();
+
+	SSL* ssl_{nullptr};
+	bool kernel_{false};
+	bool kernel_send_{false};
+
+	// Only used by the userspace relay
+	int network_fd_{-1};
+	int relay_fd_{-1};
+	unique_ptr<tcp::socket> reader_;
+	thread relay_thread_;
+};
+
+// Name of the TLS implementation in use, for log output
+string repr_tls_session(const TlsSession* session);
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <memory>
+#include <chrono>
+
+using std::string;
+using std::atomic;
+using std::unique_ptr;
+
+// Spans are only compiled in with -DDIR_SYNC_TRACE=ON, the macros expand
+// to nothing otherwise and their arguments aren't evaluated
+#ifdef DIR_SYNC_TRACE
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Records a span from here to the end of the enclosing scope
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(trace_span_, __LINE__){name}
+
+// The detail is only evaluated while tracing is enabled
+#define TRACE_SPAN_DETAIL(name, detail) \
+	TraceSpan TRACE_CONCAT(trace_span_, __LINE__){name}; \
+	if (TRACE_CONCAT(trace_span_, __LINE__).active()) { \
+		TRACE_CONCAT(trace_span_, __LINE__).set_detail(detail); \
+	}
+
+#define TRACE_THREAD_NAME(name) name_trace_thread(name)
+
+// Threads started for a session set it themselves
+#define TRACE_SESSION(session) set_trace_session(session)
+
+const bool TRACE_AVAILABLE{true};
+
+#else
+
+#define TRACE_SPAN(name) static_cast<void>(0)
+#define TRACE_SPAN_DETAIL(name, detail) static_cast<void>(0)
+#define TRACE_THREAD_NAME(name) static_cast<void>(0)
+#define TRACE_SESSION(session) static_cast<void>(0)
+
+const bool TRACE_AVAILABLE{false};
+
+#endif
+
+// Events kept per thread until they are dumped, later ones are dropped
+const unsigned int TRACE_BUFFER_EVENTS{262144};
+// The ring is allocated block by block as it fills up, threads that record 
+// few events between dumps only take one block (about 84 KB)
+const unsigned int TRACE_BLOCK_EVENTS{1024};
+
+static_assert(TRACE_BUFFER_EVENTS % TRACE_BLOCK_EVENTS == 0, 
+	"The trace ring has to consist of whole blocks");
+// Longer details (paths, mostly) are truncated
+const unsigned int TRACE_DETAIL_SIZE{47};
+
+struct trace_event {
+	// String literal, never freed
+	const char* name;
+	char detail[TRACE_DETAIL_SIZE + 1];
+	// Nanoseconds since tracing was enabled
+	long long start;
+	long long duration;
+	// Session the thread worked for, 0 outside of sessions
+	unsigned long long session;
+};
+
+// Ring of events written by a single thread and drained by dump_trace().
+// Neither side takes a lock, head and tail are only advanced by one side
+// each.
+class TraceBuffer {
+public:
+	explicit TraceBuffer(unsigned int thread_id);
+
+	bool push(const trace_event& event);
+
+	// Calls consume for every pending event and frees their slots
+	template <typename F>
+	void drain(F consume) {
+		unsigned long long head{head_.load(std::memory_order_acquire)};
+		unsigned long long tail{tail_.load(std::memory_order_relaxed)};
+
+		for (; tail < head; tail++) {
+			consume(slot(tail));
+		}
+		tail_.store(tail, std::memory_order_release);
+	}
+
+	unsigned int thread_id() const { return thread_id_; }
+
+	bool drained() const {
+		return head_.load(std::memory_order_acquire) == 
+			tail_.load(std::memory_order_relaxed);
+	}
+
+	// Guarded by the registry, unlike the events
+	string thread_name;
+	atomic<unsigned long long> dropped{0};
+	atomic<bool> retired{false};
+
+private:
+	unsigned int thread_id_;
+
+	trace_event& slot(unsigned long long index) {
+		unsigned long long position{index % TRACE_BUFFER_EVENTS};
+		return blocks_[position / TRACE_BLOCK_EVENTS][
+			position % TRACE_BLOCK_EVENTS];
+	}
+
+	// Only allocated by push(), before the first event in a block is 
+	// published, and kept until the buffer is released
+	unique_ptr<trace_event[]> blocks_[TRACE_BUFFER_EVENTS / TRACE_BLOCK_EVENTS];
+	atomic<unsigned long long> head_{0};
+	atomic<unsigned long long> tail_{0};
+};
+
+// Starts recording, spans are ignored until then. Relative paths are 
+// resolved right away, a later chdir() doesn't move the trace.
+void enable_trace(const string& path);
+
+bool trace_enabled();
+
+void name_trace_thread(const string& name);
+
+// Events the calling thread records from now on belong to the session
+void set_trace_session(unsigned long long session);
+
+unsigned long long trace_session();
+
+// Writes the events recorded so far to the trace path (plus suffix) in 
+// the Chrome trace event format (chrome://tracing, ui.perfetto.dev) and 
+// discards them. Unless session is 0 only its events are written, those 
+// of other sessions are kept for their own dump and events recorded 
+// outside of sessions are dropped.
+bool dump_trace(const string& suffix="", unsigned long long session=0);
+
+class TraceSpan {
+public:
+	explicit TraceSpan(const char* name);
+	~TraceSpan();
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+	bool active() const { return buffer_ != nullptr; }
+
+	void set_detail(const string& detail);
+
+private:
+	TraceBuffer* buffer_;
+	trace_event event_;
+	std::chrono::steady_clock::time_point start_;
+};
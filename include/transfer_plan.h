@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+
+#include "dir_sync.pb.h"
+
+#include "networking.h"
+
+using std::string;
+using std::vector;
+
+using dir_sync::FileTree;
+
+// Rough single core zlib throughput at COMPRESSION_LEVEL (bytes/s)
+const double COMPRESSION_SPEED{150e6};
+// Rough throughput of copying a file on the receiving end (bytes/s)
+const double LOCAL_COPY_SPEED{500e6};
+// Compression is not worth sampling for files below this size
+const long long MIN_COMPRESSION_SIZE{4096};
+
+enum class TransferStrategy {
+	WholeFile,
+	Compressed,
+	LocalCopy
+};
+
+struct planned_transfer {
+	string relative_path;
+	TransferStrategy strategy;
+	// Identical file on the receiving end (LocalCopy only)
+	string copy_from;
+	unsigned long long predicted_bytes;
+	// Seconds
+	double predicted_time;
+};
+
+typedef vector<planned_transfer> transfer_plan;
+
+// Compressed size / raw size of a sample at the beginning of the file
+double sample_compressibility(string relative_path, long long size, 
+	int root_fd=AT_FDCWD);
+
+// Predicted times include the latency of the link (link.rtt), local 
+// copies don't pay it. Small files are therefore copied even where the 
+// link is faster than copying.
+
+// Files that are sent from the local (master) tree at root_fd to the peer 
+// (slave)
+transfer_plan plan_sends(vector<string> file_sends, FileTree& master_tree, 
+	FileTree& slave_tree, link_estimate link, int root_fd=AT_FDCWD);
+
+// Files that are requested from the peer (slave). Compressibility of remote
+// files is unknown, they are either copied locally or sent as a whole.
+transfer_plan plan_requests(vector<string> file_requests, 
+	FileTree& master_tree, FileTree& slave_tree, link_estimate link);
+
+string repr_transfer_strategy(TransferStrategy strategy);
+
+void print_transfer_plan(transfer_plan& plan, string title);
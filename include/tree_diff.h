@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <tuple>
+
+#include "dir_sync.pb.h"
+
+using std::string;
+using std::vector;
+using std::tuple;
+
+using dir_sync::FileTree;
+using dir_sync::FileMetadata;
+
+// Files to send from master to slave and files to request from slave
+typedef tuple<vector<string>, vector<string>> file_tree_file_diff;
+// Directories of master that are missing on slave
+typedef vector<string> file_tree_dir_diff;
+
+// Hashes decide if both files have one (strict scans), size and mtime 
+// otherwise (quick check)
+bool same_content(const FileMetadata& a, const FileMetadata& b);
+
+// Files of both trees whose size matches but whose mtime doesn't, and that 
+// lack a hash on either side. Only their hashes tell if they differ, both 
+// sides fill them in before the trees are diffed.
+vector<string> ambiguous_files(const FileTree& master_tree, 
+	const FileTree& slave_tree);
+
+// Files of both trees with the same hash but different mtimes (as master 
+// entries). Ambiguous files end up here once hashed, the slave's copies 
+// adopt the master's mtime so they aren't hashed again next time.
+vector<const FileMetadata*> identical_files(const FileTree& master_tree, 
+	const FileTree& slave_tree);
+
+// Files missing on either side are transferred, differing files go from 
+// the side with the newer mtime to the other
+file_tree_file_diff diff_file_tree_files(
+	FileTree& master_tree, FileTree& slave_tree);
+
+file_tree_dir_diff diff_file_tree_directories(
+	FileTree& master_tree, FileTree& slave_tree);
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include "dir_sync.pb.h"
+
+using std::string;
+using std::vector;
+using std::atomic;
+using std::unique_ptr;
+using std::mutex;
+using std::thread;
+using std::function;
+using std::condition_variable;
+
+using dir_sync::MinimalFileMetadata;
+using dir_sync::FileResponse;
+
+// Threads writing received files by default
+const unsigned int DEFAULT_WRITERS{4};
+// Default memory budget of parts that have been received but not written
+// yet (in bytes)
+const unsigned long long DEFAULT_WRITE_BUFFER_SIZE{64ULL * 1024 * 1024};
+// Jobs queued per writer, the memory budget usually runs out first
+const unsigned int WRITE_QUEUE_SLOTS{1024};
+// Sleepers check again after this long, in case a wake up was missed
+// (milliseconds)
+const unsigned int WRITE_POOL_POLL_INTERVAL{10};
+
+enum class WriteJobType {
+	// Creates the file described by file_metadata
+	Open,
+	// Writes file_response (and the raw bytes that followed it)
+	Part,
+	// Finishes the file, sets its mtime and closes it
+	Close
+};
+
+struct write_job {
+	WriteJobType type{WriteJobType::Part};
+	MinimalFileMetadata file_metadata{};
+	FileResponse file_response{};
+	string raw_part{};
+	// Bytes counted against the memory budget
+	unsigned long long size{0};
+
+	// Cheaper than copying, messages swap their buffers
+	void swap(write_job& other);
+};
+
+// Bounded ring of jobs with a single producer (the network thread) and a
+// single consumer (one writer). Neither side takes a lock, head and tail
+// are only advanced by one side each.
+class WriteQueue {
+public:
+	WriteQueue();
+
+	// The job is taken over, false if the queue is full
+	bool push(write_job& job);
+
+	// False if the queue is empty
+	bool pop(write_job& job);
+
+private:
+	unique_ptr<write_job[]> jobs_;
+	atomic<unsigned long long> head_{0};
+	atomic<unsigned long long> tail_{0};
+};
+
+// Writers fed by one network thread. All jobs of a file go to the same
+// writer in order, files are spread across writers. Once the memory budget
+// is used up the network thread waits for the writers, the sender is then
+// slowed down by TCP.
+class WritePool {
+public:
+	// Called on the writer threads, writer is their index
+	typedef function<void(write_job& job, unsigned int writer)> job_handler;
+
+	WritePool(unsigned int writers, unsigned long long memory_budget,
+		job_handler handler);
+
+	// Waits for the writers
+	~WritePool();
+
+	WritePool(const WritePool&) = delete;
+	WritePool& operator=(const WritePool&) = delete;
+
+	unsigned int writers() const { return writer_count_; }
+
+	// Open jobs pick the writer of the file, following jobs go to the same
+	// one. The job is taken over.
+	void submit(write_job& job);
+
+	// Returns once every submitted job has been handled and the writers
+	// have stopped
+	void finish();
+
+private:
+	void run(unsigned int writer);
+
+	// Sleeps until ready() holds, the lock is only taken to sleep. ready() 
+	// may push or pop, it isn't called again once it returned true.
+	template <typename F>
+	void wait_until(F ready);
+
+	// Only takes the lock if someone sleeps
+	void wake();
+
+	unsigned int writer_count_;
+	unsigned long long memory_budget_;
+	job_handler handler_;
+
+	vector<unique_ptr<WriteQueue>> queues_;
+	vector<thread> threads_;
+	// Writer of the file being received
+	unsigned int current_writer_{0};
+	unsigned int next_writer_{0};
+
+	atomic<unsigned long long> queued_bytes_{0};
+	atomic<bool> finishing_{false};
+
+	atomic<unsigned int> sleepers_{0};
+	mutex sleep_mtx_;
+	condition_variable sleep_cv_;
+};
@@ -0,0 +1,389 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wconversion"
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+#include "fmt/format.h"
+#include "clipp.h"
+
+#pragma GCC diagnostic pop
+
+#include "dir_sync.pb.h"
+
+#include "shared.h"
+#include "networking.h"
+#include "tls.h"
+
+using std::cout;
+using std::endl;
+
+using std::string;
+using std::vector;
+using std::thread;
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+using asio::io_context;
+using asio::ip::tcp;
+using asio::ip::address_v4;
+using asio::socket_base;
+using asio::error_code;
+
+using spdlog::stdout_color_mt;
+using spdlog::set_level;
+using spdlog::level::level_enum;
+
+using fmt::format;
+
+using namespace clipp;
+
+auto console{stdout_color_mt("bench")};
+
+const char PAYLOAD_PATH[]{"payload"};
+const char CERTIFICATE_PATH[]{"bench.crt"};
+const char KEY_PATH[]{"bench.key"};
+
+struct bench_settings {
+	unsigned int part_size;
+	bool cork;
+	// 0 leaves the kernel defaults (and auto tuning) alone
+	int buffer_size;
+	bool zero_copy{false};
+	// Encrypted if set, the receiver is the TLS server
+	SSL_CTX* server_tls{nullptr};
+	SSL_CTX* client_tls{nullptr};
+};
+
+bool write_payload(unsigned long long size) {
+	int fd{open(PAYLOAD_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+
+	if (fd < 0) {
+		return false;
+	}
+
+	// Incompressible, like most of what ends up being transferred
+	std::mt19937_64 random;
+	vector<u_int64_t> block(PART_SIZE / sizeof(u_int64_t));
+	bool written{true};
+
+	for (unsigned long long offset{0}; written && offset < size; 
+		offset += PART_SIZE) {
+		for (u_int64_t& word : block) {
+			word = random();
+		}
+		written = write(fd, block.data(), PART_SIZE) == PART_SIZE;
+	}
+	close(fd);
+
+	return written;
+}
+
+// Self-signed certificate for the loopback transport comparison
+bool write_certificate() {
+	EVP_PKEY* key{EVP_EC_gen("P-256")};
+	X509* certificate{X509_new()};
+	bool written{false};
+
+	if (key != nullptr && certificate != nullptr) {
+		X509_set_version(certificate, 2);
+		ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+		X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+		X509_gmtime_adj(X509_getm_notAfter(certificate), 60 * 60);
+		X509_set_pubkey(certificate, key);
+
+		X509_NAME* name{X509_get_subject_name(certificate)};
+		X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, 
+			reinterpret_cast<const unsigned char*>("dir_sync_bench"), -1, -1, 0);
+		X509_set_issuer_name(certificate, name);
+
+		FILE* certificate_file{fopen(CERTIFICATE_PATH, "w")};
+		FILE* key_file{fopen(KEY_PATH, "w")};
+
+		written = X509_sign(certificate, key, EVP_sha256()) > 0 && 
+			certificate_file != nullptr && key_file != nullptr && 
+			PEM_write_X509(certificate_file, certificate) == 1 && 
+			PEM_write_PrivateKey(key_file, key, nullptr, nullptr, 0, nullptr, 
+				nullptr) == 1;
+
+		if (certificate_file != nullptr) {
+			fclose(certificate_file);
+		}
+		if (key_file != nullptr) {
+			fclose(key_file);
+		}
+	}
+
+	X509_free(certificate);
+	EVP_PKEY_free(key);
+
+	return written;
+}
+
+void set_buffer_size(tcp::socket& sock, int buffer_size) {
+	error_code error_code_;
+
+	if (buffer_size > 0) {
+		sock.set_option(socket_base::send_buffer_size(buffer_size), error_code_);
+		sock.set_option(socket_base::receive_buffer_size(buffer_size), 
+			error_code_);
+	}
+}
+
+// Only drains messages, disk writes would dominate the measurement
+void drain_file(tcp::acceptor& acceptor, bench_settings settings, 
+	unsigned long long& bytes_received) {
+	tcp::socket sock{acceptor.accept()};
+	set_buffer_size(sock, settings.buffer_size);
+
+	TlsSession tls_session;
+	MinimalFileMetadata file_metadata;
+	FileResponse file_response;
+	string raw_part;
+
+	bytes_received = 0;
+
+	if (settings.server_tls != nullptr && 
+		tls_session.start(sock, settings.server_tls, true) != TLS_OK) {
+		sock.close();
+		return;
+	}
+
+	Multiplexer mux{sock, tls_session.reader(sock)};
+
+	if (mux.recv(Stream::Files, file_metadata) == PROTO_TYPE_OK) {
+		while (mux.recv(Stream::Files, file_response, raw_part) == 
+			PROTO_TYPE_OK) {
+			bytes_received += file_response.has_inline_size() ? 
+				raw_part.size() : file_response.part().size();
+		}
+	}
+
+	sock.close();
+}
+
+// Seconds it takes to transfer the payload, negative on failure. 
+// transport is set to the kind of encryption that was negotiated.
+double run(io_context& ctx, bench_settings settings, unsigned long long size, 
+	string& transport) {
+	tcp::acceptor acceptor{ctx, tcp::endpoint{address_v4::loopback(), 0}};
+	unsigned long long bytes_received{0};
+
+	thread receiver{drain_file, std::ref(acceptor), settings, 
+		std::ref(bytes_received)};
+
+	tcp::socket sock{ctx};
+	sock.connect(acceptor.local_endpoint());
+
+	sock.set_option(tcp::no_delay(true));
+	set_buffer_size(sock, settings.buffer_size);
+
+	TlsSession tls_session;
+	transport = repr_tls_session(nullptr);
+
+	if (settings.client_tls != nullptr) {
+		if (tls_session.start(sock, settings.client_tls, false) != TLS_OK) {
+			sock.close();
+			receiver.join();
+			return -1;
+		}
+		transport = repr_tls_session(&tls_session);
+
+		// Data sent through the userspace relay is always copied
+		if (settings.zero_copy && !tls_session.kernel_send()) {
+			sock.close();
+			receiver.join();
+			return -1;
+		}
+	}
+
+	int tcp_fd{tls_session.network_fd(sock)};
+
+	set_cork(tcp_fd, settings.cork);
+
+	steady_clock::time_point start{steady_clock::now()};
+
+	Multiplexer mux{sock, tls_session.reader(sock)};
+
+	send_file(mux, PAYLOAD_PATH, {nullptr, "", false, settings.part_size, 
+		settings.zero_copy});
+	set_cork(tcp_fd, false);
+	sock.close();
+
+	receiver.join();
+
+	double seconds{duration<double>(steady_clock::now() - start).count()};
+
+	return bytes_received == size ? seconds : -1;
+}
+
+link_estimate probe_loopback(io_context& ctx) {
+	tcp::acceptor acceptor{ctx, tcp::endpoint{address_v4::loopback(), 0}};
+	link_estimate client_link{0, 0};
+
+	thread client{[&]() {
+		tcp::socket sock{ctx};
+		sock.connect(acceptor.local_endpoint());
+		answer_link_probes(sock, client_link);
+	}};
+
+	tcp::socket sock{acceptor.accept()};
+	link_estimate link{0, 0};
+	probe_link(sock, link);
+
+	client.join();
+
+	return link;
+}
+
+int main(int argc, char* argv[]) {
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	unsigned long long size{256};
+	bool verbose{false};
+
+	auto cli = (
+		(option("-s", "--size").doc(
+			"payload size in MiB") & value("size", size)),
+		option("--verbose").set(verbose).doc(
+			"log additional debug info")
+	);
+
+	if (!parse(argc, argv, cli)) {
+		cout << make_man_page(cli, argv[0]);
+		return 0;
+	}
+
+	if (verbose) {
+		set_level(level_enum::debug);
+	}
+
+	size *= 1024 * 1024;
+
+	char directory[]{"/tmp/dir_sync_bench.XXXXXX"};
+
+	if (mkdtemp(directory) == nullptr || chdir(directory) != 0) {
+		console->error("Could not create temporary directory.");
+		return errno;
+	}
+
+	if (!write_payload(size)) {
+		console->error("Could not write payload.");
+		return errno;
+	}
+
+	io_context ctx;
+
+	link_estimate link{probe_loopback(ctx)};
+
+	cout << format("Loopback probe: RTT {:.3f} ms, {:.1f} MB/s, "
+		"tuned part size {} B", link.rtt * 1e3, link.throughput / 1e6, 
+		tuned_part_size(link)) << endl;
+
+	cout << format("{:>10} {:>6} {:>10} {:>10} {:>12}", "part size", "cork", 
+		"buffers", "seconds", "MB/s") << endl;
+
+	for (unsigned int part_size{MIN_PART_SIZE}; part_size <= MAX_PART_SIZE; 
+		part_size *= 4) {
+		for (bool cork : {false, true}) {
+			for (int buffer_size : {0, 262144, MAX_SOCKET_BUFFER / 16}) {
+				string transport;
+				double seconds{run(ctx, {part_size, cork, buffer_size}, size, 
+					transport)};
+
+				string buffers{buffer_size > 0 ? 
+					format("{}", buffer_size) : "default"};
+
+				if (seconds < 0) {
+					cout << format("{:>10} {:>6} {:>10} {:>10}", part_size, cork, 
+						buffers, "failed") << endl;
+				} else {
+					cout << format("{:>10} {:>6} {:>10} {:>10.3f} {:>12.1f}", 
+						part_size, cork, buffers, seconds, size / seconds / 1e6) << endl;
+				}
+			}
+		}
+	}
+
+	// Transports at the tuned settings. TLS is measured with the record 
+	// layer in userspace and with kTLS, the latter only differs on hosts 
+	// that support it.
+	struct transport_contexts {
+		string name;
+		SSL_CTX* server_tls;
+		SSL_CTX* client_tls;
+	};
+
+	vector<transport_contexts> transports{{"plaintext", nullptr, nullptr}};
+
+	if (write_certificate()) {
+		for (bool kernel : {false, true}) {
+			transport_contexts contexts{kernel ? "kernel TLS" : "userspace TLS", 
+				create_tls_server_context(CERTIFICATE_PATH, KEY_PATH, kernel), 
+				create_tls_client_context("", kernel)};
+
+			if (contexts.server_tls == nullptr || contexts.client_tls == nullptr) {
+				console->warn("Could not create TLS contexts.");
+				SSL_CTX_free(contexts.server_tls);
+				SSL_CTX_free(contexts.client_tls);
+				continue;
+			}
+
+			// Self-signed, only the transport is measured
+			SSL_CTX_set_verify(contexts.client_tls, SSL_VERIFY_NONE, nullptr);
+			transports.push_back(contexts);
+		}
+	}
+
+	cout << endl << format("{:>16} {:>22} {:>10} {:>10} {:>12}", "requested", 
+		"negotiated", "zero copy", "seconds", "MB/s") << endl;
+
+	for (const transport_contexts& contexts : transports) {
+		for (bool zero_copy : {false, true}) {
+			bench_settings settings{tuned_part_size(link), true, 0, zero_copy, 
+				contexts.server_tls, contexts.client_tls};
+
+			string transport;
+			double seconds{run(ctx, settings, size, transport)};
+
+			if (seconds < 0) {
+				cout << format("{:>16} {:>22} {:>10} {:>10}", contexts.name, 
+					transport, zero_copy, "n/a") << endl;
+			} else {
+				cout << format("{:>16} {:>22} {:>10} {:>10.3f} {:>12.1f}", 
+					contexts.name, transport, zero_copy, seconds, 
+					size / seconds / 1e6) << endl;
+			}
+		}
+	}
+
+	for (const transport_contexts& contexts : transports) {
+		SSL_CTX_free(contexts.server_tls);
+		SSL_CTX_free(contexts.client_tls);
+	}
+
+	unlink(CERTIFICATE_PATH);
+	unlink(KEY_PATH);
+	unlink(PAYLOAD_PATH);
+	rmdir(directory);
+
+	return 0;
+}
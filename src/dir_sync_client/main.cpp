@@ -1,5 +1,9 @@
 #include <iostream>
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <algorithm>
 
 #include <unistd.h>
 #include <errno.h>
@@ -22,11 +26,20 @@
 #include "shared.h"
 #include "constants.h"
 #include "networking.h"
+#include "tls.h"
+#include "journal.h"
+#include "trace.h"
 
 using std::cout;
 
 using std::ifstream;
 
+using std::unordered_map;
+using std::unordered_set;
+using std::thread;
+
+using std::max;
+
 using asio::io_context;
 using asio::ip::tcp;
 using asio::ip::address;
@@ -36,65 +49,174 @@ using spdlog::stdout_color_mt;
 using spdlog::set_level;
 using spdlog::level::level_enum;
 
+using dir_sync::FileMetadata;
+
 using json = nlohmann::json;
 
 using namespace clipp;
 
 auto console{stdout_color_mt("client")};
 
-int process_file_requests(tcp::socket& sock) {
-	vector<string> file_paths;
+// Sends the tree, or only what changed since the last session if both 
+// peers journaled it. record is filled with what has to be journaled 
+// once the session is done (if anything).
+int send_file_tree(Multiplexer& mux, const SyncJournal& journal, 
+	const string& client_id, const FileTree& file_tree, JournalRecord& record) {
+	SyncGeneration client_generation;
+	client_generation.set_peer_id(client_id);
 
-	FileRequest file_request;
+	SyncGeneration server_generation;
 
-	while (true) {
-		if (recv_proto(sock, file_request) == PROTO_TYPE_OK) {
-			console->debug("File '{}' requested", 
-				file_request.relative_path());
+	if (mux.send(Stream::Control, client_generation) > 0 || 
+		mux.recv(Stream::Control, server_generation) != PROTO_TYPE_OK) {
+		return PROTO_TYPE_WRONG;
+	}
 
-			file_paths.push_back(file_request.relative_path());
+	const string& server_id{server_generation.peer_id()};
+	JournalRecord known;
+	bool journaled{!client_id.empty() && journal.load(server_id, known)};
 
-		} else {
-			break;
+	record.Clear();
+
+	// Updated along with the changes sent, computed for full trees
+	string digest;
+
+	if (journaled && known.generation() == server_generation.generation()) {
+		digest = record_digest(known);
+	}
+
+	if (digest.empty() || digest != server_generation.digest()) {
+		FileTree full_tree{file_tree};
+		known.set_generation(max<unsigned long long>(
+			journaled ? known.generation() : 0, server_generation.generation()));
+
+		if (!client_id.empty() && valid_peer_id(server_id)) {
+			full_tree.set_generation(known.generation() + 1);
 		}
+		if (mux.send(Stream::Control, full_tree) > 0) {
+			return PROTO_TYPE_WRONG;
+		}
+		digest.clear();
+	} else {
+		FileTree delta{tree_delta(known.tree(), file_tree, &digest)};
+		delta.set_base_generation(known.generation());
+		delta.set_generation(known.generation() + 1);
+
+		console->debug("Sending {} changed, {} removed files since generation {}.", 
+			delta.files_size(), delta.removed_files_size(), known.generation());
+
+		if (mux.send(Stream::Control, delta) > 0) {
+			return PROTO_TYPE_WRONG;
+		}
+	}
+
+	if (!client_id.empty() && valid_peer_id(server_id)) {
+		record.set_peer_id(server_id);
+		record.set_generation(known.generation() + 1);
+		*record.mutable_tree() = file_tree;
+		record.set_digest(digest.empty() ? tree_digest(file_tree) : digest);
+	}
+
+	return PROTO_TYPE_OK;
+}
+
+int send_requested_files(Multiplexer& mux, int tcp_fd, 
+	const vector<string>& file_paths, FileTree& file_tree, 
+	PartSizer& part_sizer, bool zero_copy) {
+	int error_code_{};
+	unordered_map<string, string> hashes;
+
+	for (const FileMetadata& file : file_tree.files()) {
+		hashes[file.relative_path()] = file.hash();
 	}
 
-	int recv_error_code{};
+	set_cork(tcp_fd, true);
 
 	for (const string& file_path : file_paths) {
-		recv_error_code = send_file(sock, file_path);
+		auto hash = hashes.find(file_path);
 
-		if (recv_error_code < 0) {
-			return recv_error_code;
+		// Only files of the tree that was sent are served
+		if (hash == hashes.end()) {
+			console->warn("Ignored request for unknown file '{}'.", file_path);
+			continue;
+		}
+
+		if (send_file(mux, file_path, 
+			{nullptr, hash->second, false, part_sizer.largest(), zero_copy, 
+			AT_FDCWD, &part_sizer}) > 0) {
+			console->warn("Could not send file '{}'.", file_path);
 		}
 	}
 
-	return 0;
+	error_code_ = send_protocol_separator(mux, Stream::Files);
+	set_cork(tcp_fd, false);
+
+	return error_code_;
 }
 
-int recv_directories(tcp::socket& sock) {
-	DirectoryRequest dir_response;
+// Directories are created and hashes sent back right away, requested files 
+// are collected. Requests may arrive in any order, the server ends the 
+// stage with one separator for directories and one for files.
+int recv_requests(Multiplexer& mux, vector<string>& file_paths) {
+	MessageRouter router;
+	int separators{0};
 
-	int recv_error_code{};
+	router.on<DirectoryRequest>([](DirectoryRequest& dir_response) {
+		if (!safe_relative_path(dir_response.relative_path())) {
+			console->warn("Ignored directory '{}' outside the sync root", 
+				dir_response.relative_path());
+			return ROUTE_NEXT;
+		}
 
-	while (true) {
-		recv_error_code = recv_proto(sock, dir_response);
+		console->debug("Creating directory '{}'", dir_response.relative_path());
 
-		if (recv_error_code != PROTO_TYPE_OK) {
-			return recv_error_code;
-		} else {
-			console->debug("Creating directory '{}'", 
+		if (mkdir(dir_response.relative_path().c_str(), 
+			S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) > 0) {
+			console->warn("Could not create directory '{}'", 
 				dir_response.relative_path());
+		}
 
-			if (mkdir(dir_response.relative_path().c_str(), 
-				S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) > 0) {
-				console->warn("Could not create directory '{}'", 
-					dir_response.relative_path());
+		return ROUTE_NEXT;
+	});
+	router.on<FileRequest>([&](FileRequest& file_request) {
+		console->debug("File '{}' requested", file_request.relative_path());
+
+		file_paths.push_back(file_request.relative_path());
+
+		return ROUTE_NEXT;
+	});
+	// Hashes of the files the server asked for
+	unordered_map<string, string> hashes;
+
+	// Files the server can't tell apart by their metadata
+	router.on<FileHash>([&](FileHash& file_hash) {
+		// Identical to the server's copy, only the mtime differs. The hash 
+		// guards against a file that has changed since it was hashed.
+		if (file_hash.has_mtime()) {
+			auto hash = hashes.find(file_hash.relative_path());
+
+			if (hash != hashes.end() && !hash->second.empty() && 
+				hash->second == file_hash.hash() && 
+				!set_mtime(file_hash.mtime(), file_hash.relative_path())) {
+				console->warn("Could not set mtime for '{}'", 
+					file_hash.relative_path());
 			}
+
+			return ROUTE_NEXT;
 		}
-	}
 
-	return 0;
+		file_hash.set_hash(hash_file(file_hash.relative_path()));
+		hashes[file_hash.relative_path()] = file_hash.hash();
+
+		int error_code_{mux.send(Stream::Control, file_hash)};
+
+		return error_code_ > 0 ? error_code_ : ROUTE_NEXT;
+	});
+	router.on<ProtocolSeparator>([&](ProtocolSeparator&) {
+		return ++separators < 2 ? ROUTE_NEXT : PROTO_TYPE_STAGE_END;
+	});
+
+	return mux.route(Stream::Control, router);
 }
 
 int main(int argc, char* argv[]) {
@@ -107,19 +229,54 @@ int main(int argc, char* argv[]) {
 	unsigned short port{default_port};
 	bool strict{false};
 	bool verbose{false};
+	vector<string> filter_rules;
+	bool tls{false};
+	string tls_ca;
+	bool zero_copy{false};
+	string trace;
+	string root;
+	unsigned int writers{DEFAULT_WRITERS};
+	unsigned long long write_buffer_size{
+		DEFAULT_WRITE_BUFFER_SIZE / (1024 * 1024)};
 
 	auto cli = (
 		value("directory", directory),
 		value("address", address),
 		option("--strict").set(strict).doc(
-			"compare hashes and file metadata"),
+			"hash every file instead of comparing size and mtime"),
 		option("--verbose").set(verbose).doc(
 			"log additional debug info"),		
 		(option("-p", "--port").doc(
 			"provide alternative port") & value("port", port)),
 		(option("-c", "--config").doc(
 			"override command line parameters with config") & value(
-			"config", config))
+			"config", config)),
+		repeatable(option("-x", "--exclude").doc(
+			"exclude paths matching a gitignore-style pattern") & 
+			value("pattern", filter_rules)),
+		repeatable(option("-i", "--include").doc(
+			"re-include excluded paths matching a pattern") & 
+			value("pattern").call([&](const char* pattern) {
+				filter_rules.push_back(string("!") + pattern);
+			})),
+		option("--tls").set(tls).doc(
+			"encrypt the connection"),
+		(option("--tls-ca").doc(
+			"CA certificates used to verify the server (system default if omitted)") & 
+			value("tls_ca", tls_ca)),
+		option("--zero-copy").set(zero_copy).doc(
+			"send files with sendfile() on plaintext connections"),
+		(option("--trace").doc(
+			"write a Chrome trace of the session (needs a build with "
+			"-DDIR_SYNC_TRACE=ON)") & value("trace", trace)),
+		(option("-r", "--root").doc(
+			"named sync root of the server (its default root if omitted)") & 
+			value("root", root)),
+		(option("--writers").doc(
+			"threads writing received files") & value("writers", writers)),
+		(option("--write-buffer").doc(
+			"memory budget of received parts waiting to be written in MiB") & 
+			value("write_buffer", write_buffer_size))
 	);
 
 	if (!parse(argc, argv, cli)) {
@@ -136,6 +293,20 @@ int main(int argc, char* argv[]) {
 				verbose = j.value("verbose", verbose);
 				port = j.value("port", port);
 
+				for (const string& pattern : j.value("exclude", vector<string>{})) {
+					filter_rules.push_back(pattern);
+				}
+				for (const string& pattern : j.value("include", vector<string>{})) {
+					filter_rules.push_back("!" + pattern);
+				}
+				tls = j.value("tls", tls);
+				tls_ca = j.value("tls_ca", tls_ca);
+				zero_copy = j.value("zero_copy", zero_copy);
+				trace = j.value("trace", trace);
+				root = j.value("root", root);
+				writers = j.value("writers", writers);
+				write_buffer_size = j.value("write_buffer", write_buffer_size);
+
 				console->info("Config file '{}' applied.", config);
 			} else {
 				console->warn("Config file '{}' could not be applied.", 
@@ -147,7 +318,33 @@ int main(int argc, char* argv[]) {
 			set_level(level_enum::debug);
 		}
 
+		if (!trace.empty() && !TRACE_AVAILABLE) {
+			console->warn("Tracing is not compiled in, rebuild with "
+				"-DDIR_SYNC_TRACE=ON.");
+		} else if (!trace.empty()) {
+			enable_trace(trace);
+			TRACE_THREAD_NAME("client");
+		}
+
+		PathFilter path_filter;
+
+		for (const string& rule : filter_rules) {
+			path_filter.add_rule(rule);
+		}
+
+		SSL_CTX* tls_ctx{nullptr};
+
+		if (tls || !tls_ca.empty()) {
+			tls_ctx = create_tls_client_context(tls_ca);
+
+			if (tls_ctx == nullptr) {
+				return TLS_CONTEXT_ERR;
+			}
+		}
+
 		if (chdir(directory.c_str()) == 0) {
+			string client_id{local_peer_id()};
+			SyncJournal journal;
 
 			io_context io_context;
 			error_code error_code_;
@@ -158,40 +355,130 @@ int main(int argc, char* argv[]) {
 
 			sock.connect(endpoint, error_code_);
 			
+			// The socket is closed explicitly before the session ends
+			TlsSession tls_session;
+
+			if (!error_code_ && tls_ctx != nullptr) {
+				if (tls_session.start(sock, tls_ctx, false, address) != TLS_OK) {
+					sock.close();
+					return TLS_HANDSHAKE_ERR;
+				}
+
+				console->debug("Encryption: {}", repr_tls_session(&tls_session));
+
+				// Only the kernel can encrypt data that never enters userspace
+				zero_copy = zero_copy && tls_session.kernel_send();
+			}
+
+			// Both are sock itself unless TLS is relayed in userspace
+			tcp::socket& read_sock{tls_session.reader(sock)};
+			int tcp_fd{tls_session.network_fd(sock)};
+
 			if (!error_code_) {
 				SanityCheck sanity_check = run_sanity_check();
 
+				if (!root.empty()) {
+					sanity_check.set_root(root);
+				}
+
 				if (send_proto(sock, sanity_check) > 0) {
 					console->error("Could not send SanityCheck.");
+					sock.close();
+					return CONNECTION_COULD_NOT_BE_ESTABLISHED;
 				}
 
-				FileTree file_tree{get_file_tree(".")};
+				link_estimate link{0, 0};
 
-				if (send_proto(sock, file_tree) > 0) {
+				if (answer_link_probes(sock, read_sock, link) > 0) {
+					console->error("Could not measure link.");
+
+					// The server hangs up on roots it doesn't serve
+					if (!root.empty()) {
+						console->error("Is root '{}' served by the server?", root);
+					}
+					sock.close();
+					return CONNECTION_COULD_NOT_BE_ESTABLISHED;
+				}
+
+				tune_socket(tcp_fd, link);
+
+				PartSizer part_sizer{tcp_fd, link};
+
+				FileTree file_tree{get_file_tree(".", path_filter, strict)};
+
+				Multiplexer mux{sock, read_sock};
+				JournalRecord journal_record;
+
+				if (send_file_tree(mux, journal, client_id, file_tree, 
+					journal_record) > 0) {
 					console->error("Could not transfer FileTree.");
+					sock.close();
+					return SYNC_INCOMPLETE;
 				}
 
-				if (recv_directories(sock) > 0) {
-					console->error("Could not create requested directories.");
+				vector<string> file_requests;
+
+				if (recv_requests(mux, file_requests) > 0) {
+					console->error("Could not receive requests.");
+					sock.close();
+					return SYNC_INCOMPLETE;
 				}
 
-				console->debug("Received directories");
+				console->debug("Received requests");
+
+				bool sent{true};
+
+				// Uploads run alongside the downloads
+				thread uploader{[&]() {
+					TRACE_THREAD_NAME("uploader");
+
+					if (send_requested_files(mux, tcp_fd, file_requests, file_tree, 
+						part_sizer, zero_copy) > 0) {
+						console->error("Could not process file requests.");
+						sent = false;
+					}
+
+					console->debug("Processed file requests");
 
-				if (recv_files(sock) > 0) {
+					unordered_set<string> sent_paths(file_requests.begin(), 
+						file_requests.end());
+
+					if (serve_chunk_requests(mux, sent_paths, 
+						part_sizer.largest()) > 0) {
+						console->error("Could not resend damaged file parts.");
+						sent = false;
+					}
+				}};
+
+				bool received{recv_files(mux, {AT_FDCWD, writers, 
+					write_buffer_size * 1024 * 1024}) == FILE_RECV_OK};
+
+				if (!received) {
 					console->error("Could not receive missing files.");
+
+					// Unblocks the uploader
+					mux.shutdown();
 				}
 
 				console->debug("Received files");
 
-				if (process_file_requests(sock)) {
-					console->error("Could not process file requests.");
+				uploader.join();
+
+				// The server journals the same record once it's done
+				if (received && sent && journal_record.has_peer_id() && 
+					!journal.store(journal_record)) {
+					console->warn("Could not journal session.");
 				}
 
-				console->debug("Processed file requests");
+				sock.close();
 
-				send_protocol_separator(sock);
+				if (trace_enabled() && !dump_trace()) {
+					console->warn("Could not write trace.");
+				}
 
-				sock.close();
+				if (!received || !sent) {
+					return SYNC_INCOMPLETE;
+				}
 			} else {
 				console->error("Could not connect to server");
 				return CONNECTION_COULD_NOT_BE_ESTABLISHED;					
@@ -0,0 +1,679 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <ftw.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wconversion"
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+#include "fmt/format.h"
+#include "clipp.h"
+
+#pragma GCC diagnostic pop
+
+#include "dir_sync.pb.h"
+
+#include "shared.h"
+#include "constants.h"
+#include "networking.h"
+#include "multiplexer.h"
+#include "path_filter.h"
+#include "tcp_info.h"
+
+using std::cout;
+using std::endl;
+
+using std::string;
+using std::vector;
+using std::thread;
+using std::atomic;
+using std::mutex;
+using std::lock_guard;
+using std::ifstream;
+using std::unordered_map;
+using std::unordered_set;
+
+using std::sort;
+using std::max;
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+
+using asio::io_context;
+using asio::ip::tcp;
+using asio::ip::address;
+using asio::error_code;
+
+using spdlog::stdout_color_mt;
+using spdlog::set_level;
+using spdlog::level::level_enum;
+
+using dir_sync::FileMetadata;
+using dir_sync::DirectoryMetadata;
+
+using fmt::format;
+
+using namespace clipp;
+
+auto console{stdout_color_mt("loadgen")};
+
+// Time the spawned server gets to start listening (milliseconds)
+const int SERVER_START_TIMEOUT{5000};
+// Tree of the spawned server, and a pristine copy of it that the trees of 
+// the clients (CLIENT_DIRECTORY.<client>) are made from
+const char SERVER_DIRECTORY[]{"server"};
+const char CLIENT_DIRECTORY[]{"client"};
+
+struct loadgen_settings {
+	unsigned short port;
+	unsigned int files;
+	unsigned int file_size;
+	// Fraction of the server's files that differ on a client
+	double divergence;
+	unsigned int sessions;
+	// Pause between the sessions of a client (milliseconds)
+	unsigned int think_time;
+};
+
+// Outcome of one simulated session
+struct session_result {
+	bool completed;
+	// Seconds until the connection is established (the kernel's backlog)
+	double connect_time;
+	// Seconds from sending the SanityCheck until the server starts probing 
+	// the link: waiting for a worker and checking the SanityCheck
+	double wait_time;
+	double completion_time;
+	// Payload bytes in both directions, as counted by the kernel
+	unsigned long long bytes;
+};
+
+enum class Divergence {
+	None,
+	// Sent by the server
+	Missing,
+	Outdated,
+	// Requested by the server
+	Newer
+};
+
+// Content of a file of the server's tree, the same every time
+string file_content(unsigned int index, unsigned int size) {
+	std::mt19937_64 random{index};
+	string data(size, '\0');
+
+	for (char& byte : data) {
+		byte = static_cast<char>(random());
+	}
+
+	return data;
+}
+
+bool write_file(int root_fd, const string& path, const string& data, 
+	time_t mtime) {
+	int fd{openat(root_fd, path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+
+	bool written{fd >= 0 && write(fd, data.data(), data.size()) == 
+		static_cast<ssize_t>(data.size())};
+	close(fd);
+
+	return written && set_mtime(mtime, path, root_fd);
+}
+
+// Written again before every round, files uploaded by the clients of 
+// earlier rounds are replaced
+bool write_master_tree(const char* root, const loadgen_settings& settings, 
+	time_t mtime) {
+	mkdir(root, S_IRWXU);
+	mkdir(format("{}/data", root).c_str(), S_IRWXU);
+
+	for (unsigned int i{0}; i < settings.files; i++) {
+		if (!write_file(AT_FDCWD, format("{}/data/{}", root, i), 
+			file_content(i, settings.file_size), mtime)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Decided once per client, every session of it diverges the same way
+vector<Divergence> client_divergences(const loadgen_settings& settings, 
+	unsigned int seed) {
+	std::mt19937 random{seed};
+	std::uniform_real_distribution<double> chance{0, 1};
+	vector<Divergence> divergences(settings.files, Divergence::None);
+
+	for (Divergence& divergence : divergences) {
+		if (chance(random) < settings.divergence) {
+			divergence = static_cast<Divergence>(1 + random() % 3);
+		}
+	}
+
+	return divergences;
+}
+
+// Copies the pristine tree, the descriptor of the copy is returned (-1 on 
+// failure)
+int create_client_tree(const string& root, const loadgen_settings& settings, 
+	time_t mtime) {
+	if (mkdir(root.c_str(), S_IRWXU) != 0 || 
+		mkdir(format("{}/data", root).c_str(), S_IRWXU) != 0) {
+		return -1;
+	}
+
+	for (unsigned int i{0}; i < settings.files; i++) {
+		string path{format("{}/data/{}", root, i)};
+
+		if (!copy_local_file(format("{}/data/{}", CLIENT_DIRECTORY, i), path) || 
+			!set_mtime(mtime, path)) {
+			return -1;
+		}
+	}
+
+	return open(root.c_str(), O_RDONLY | O_DIRECTORY);
+}
+
+// Applied before every session, the previous one brought the files in line 
+// with the server. Diverging files have the size of the original, only 
+// their hashes tell them apart.
+bool diverge_client_tree(int root_fd, const vector<Divergence>& divergences, 
+	const loadgen_settings& settings, time_t mtime) {
+	for (unsigned int i{0}; i < divergences.size(); i++) {
+		string path{format("data/{}", i)};
+		string data;
+
+		switch (divergences[i]) {
+			case Divergence::None:
+				break;
+			case Divergence::Missing:
+				if (unlinkat(root_fd, path.c_str(), 0) != 0 && errno != ENOENT) {
+					return false;
+				}
+				break;
+			case Divergence::Outdated:
+			case Divergence::Newer:
+				data = file_content(i, settings.file_size);
+
+				if (!data.empty()) {
+					data[0] ^= 1;
+				}
+
+				if (!write_file(root_fd, path, data, 
+					divergences[i] == Divergence::Newer ? mtime + 3600 : 
+					mtime - 3600)) {
+					return false;
+				}
+				break;
+		}
+	}
+
+	return true;
+}
+
+// Client side of a session on the tree at root_fd, see dir_sync_client
+session_result run_session(const loadgen_settings& settings, int root_fd) {
+	session_result result{false, 0, 0, 0, 0};
+
+	io_context ctx;
+	error_code error_code_;
+
+	tcp::socket sock{ctx};
+	tcp::endpoint endpoint{address::from_string("127.0.0.1"), settings.port};
+
+	steady_clock::time_point start{steady_clock::now()};
+
+	sock.connect(endpoint, error_code_);
+	result.connect_time = duration<double>(steady_clock::now() - start).count();
+
+	SanityCheck sanity_check{run_sanity_check()};
+
+	if (error_code_ || send_proto(sock, sanity_check) > 0) {
+		console->debug("Could not connect.");
+		return result;
+	}
+
+	steady_clock::time_point checked{steady_clock::now()};
+
+	// The server only starts probing once a worker picked the session up
+	sock.wait(tcp::socket::wait_read, error_code_);
+	result.wait_time = duration<double>(steady_clock::now() - checked).count();
+
+	link_estimate link{0, 0};
+
+	if (error_code_ || answer_link_probes(sock, link) > 0) {
+		console->debug("Could not measure link.");
+		return result;
+	}
+
+	tune_socket(sock.native_handle(), link);
+
+	// The probes aren't part of the synchronization
+	tcp_link_info probed{};
+	read_tcp_info(sock.native_handle(), probed);
+
+	FileTree file_tree{get_file_tree(root_fd, PathFilter(), false)};
+	unordered_set<string> paths;
+
+	for (const FileMetadata& file : file_tree.files()) {
+		paths.insert(file.relative_path());
+	}
+
+	Multiplexer mux{sock};
+
+	// Without a peer id the server doesn't journal the session
+	SyncGeneration client_generation;
+	client_generation.set_peer_id("");
+	SyncGeneration server_generation;
+
+	if (mux.send(Stream::Control, client_generation) > 0 ||
+		mux.recv(Stream::Control, server_generation) != PROTO_TYPE_OK ||
+		mux.send(Stream::Control, file_tree) > 0) {
+		console->debug("Could not transfer FileTree.");
+		mux.shutdown();
+		return result;
+	}
+
+	MessageRouter router;
+	vector<string> file_requests;
+	int separators{0};
+
+	router.on<DirectoryRequest>([&](DirectoryRequest& directory_request) {
+		if (safe_relative_path(directory_request.relative_path())) {
+			mkdirat(root_fd, directory_request.relative_path().c_str(), S_IRWXU);
+		}
+
+		return ROUTE_NEXT;
+	});
+	router.on<FileRequest>([&](FileRequest& file_request) {
+		if (paths.count(file_request.relative_path()) > 0) {
+			file_requests.push_back(file_request.relative_path());
+		}
+
+		return ROUTE_NEXT;
+	});
+	// Diverging files only differ in content
+	router.on<FileHash>([&](FileHash& file_hash) {
+		if (file_hash.has_mtime()) {
+			set_mtime(file_hash.mtime(), file_hash.relative_path(), root_fd);
+			return ROUTE_NEXT;
+		}
+
+		file_hash.set_hash(hash_file(file_hash.relative_path(), root_fd));
+
+		int error_code_{mux.send(Stream::Control, file_hash)};
+
+		return error_code_ > 0 ? error_code_ : ROUTE_NEXT;
+	});
+	router.on<ProtocolSeparator>([&](ProtocolSeparator&) {
+		return ++separators < 2 ? ROUTE_NEXT : PROTO_TYPE_STAGE_END;
+	});
+
+	if (mux.route(Stream::Control, router) > 0) {
+		console->debug("Could not receive requests.");
+		mux.shutdown();
+		return result;
+	}
+
+	bool sent{true};
+
+	thread uploader{[&]() {
+		unsigned int part_size{tuned_part_size(link)};
+
+		for (const string& file_path : file_requests) {
+			sent = send_file(mux, file_path, {nullptr, "", false, part_size, 
+				false, root_fd}) == FILE_SEND_OK && sent;
+		}
+
+		unordered_set<string> sent_paths(file_requests.begin(), 
+			file_requests.end());
+
+		sent = send_protocol_separator(mux, Stream::Files) == SEND_OK &&
+			serve_chunk_requests(mux, sent_paths, part_size, root_fd) == 
+			CHUNK_REPAIR_OK && sent;
+	}};
+
+	// One writer per client, there are many of them
+	bool received{recv_files(mux, {root_fd, 1, DEFAULT_WRITE_BUFFER_SIZE / 16}) 
+		== FILE_RECV_OK};
+
+	if (!received) {
+		console->debug("Could not receive files.");
+		mux.shutdown();
+	}
+
+	uploader.join();
+
+	if (!sent) {
+		console->debug("Could not send files.");
+	}
+
+	tcp_link_info info{};
+
+	if (read_tcp_info(sock.native_handle(), info)) {
+		result.bytes = info.bytes_acked - probed.bytes_acked + 
+			info.bytes_received - probed.bytes_received;
+	}
+	sock.close();
+
+	result.completed = received && sent;
+	result.completion_time = duration<double>(
+		steady_clock::now() - start).count();
+
+	return result;
+}
+
+double percentile(vector<double> values, double fraction) {
+	if (values.empty()) {
+		return 0;
+	}
+
+	sort(values.begin(), values.end());
+
+	return values[static_cast<size_t>(fraction * (values.size() - 1) + 0.5)];
+}
+
+// Resident set size of a process in KiB, 0 if it can't be determined
+unsigned long long resident_set_size(pid_t pid) {
+	ifstream status(format("/proc/{}/status", pid));
+	string line;
+
+	while (getline(status, line)) {
+		if (line.compare(0, 6, "VmRSS:") == 0) {
+			return std::stoull(line.substr(6));
+		}
+	}
+
+	return 0;
+}
+
+pid_t spawn_server(string server_path, string directory, unsigned short port) {
+	pid_t pid{fork()};
+
+	if (pid == 0) {
+		int null_fd{open("/dev/null", O_WRONLY)};
+		dup2(null_fd, STDOUT_FILENO);
+		dup2(null_fd, STDERR_FILENO);
+
+		string port_argument{format("{}", port)};
+
+		execl(server_path.c_str(), server_path.c_str(), directory.c_str(),
+			"-p", port_argument.c_str(), nullptr);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+// The server drops connections that don't start with a SanityCheck
+bool wait_for_server(unsigned short port) {
+	for (int waited{0}; waited < SERVER_START_TIMEOUT; waited += 50) {
+		io_context ctx;
+		error_code error_code_;
+		tcp::socket sock{ctx};
+
+		sock.connect(tcp::endpoint{address::from_string("127.0.0.1"), port}, 
+			error_code_);
+
+		if (!error_code_) {
+			return true;
+		}
+
+		std::this_thread::sleep_for(milliseconds(50));
+	}
+
+	return false;
+}
+
+int remove_entry(const char* path, const struct stat*, int, FTW*) {
+	return remove(path);
+}
+
+bool remove_tree(const string& path) {
+	return nftw(path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+// Stops the spawned server and removes the temporary directory, whichever 
+// way main() returns
+struct loadgen_cleanup {
+	string directory;
+	bool keep;
+	pid_t server_pid;
+
+	~loadgen_cleanup() {
+		if (server_pid > 0) {
+			kill(server_pid, SIGTERM);
+			waitpid(server_pid, nullptr, 0);
+		}
+
+		if (directory.empty()) {
+			return;
+		} else if (keep) {
+			console->info("Trees have been left in '{}'.", directory);
+		} else if (!remove_tree(directory)) {
+			console->warn("Could not remove '{}'.", directory);
+		}
+	}
+};
+
+int main(int argc, char* argv[]) {
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	loadgen_settings settings{default_port, 200, 16384, 0.1, 1, 0};
+	vector<unsigned int> client_counts;
+	string server_path;
+	bool keep{false};
+	bool verbose{false};
+
+	auto cli = (
+		(option("-p", "--port").doc(
+			"port of the spawned server") & value("port", settings.port)),
+		(option("--server").doc(
+			"dir_sync_server binary to spawn (next to this one if omitted)") &
+			value("path", server_path)),
+		(option("-n", "--clients").doc(
+			"numbers of concurrent clients to measure (default 1 10 100)") &
+			values("clients", client_counts)),
+		(option("--files").doc(
+			"files in the server's tree") & value("files", settings.files)),
+		(option("--file-size").doc(
+			"size of each file in bytes") & value("size", settings.file_size)),
+		(option("--divergence").doc(
+			"fraction of files that differ on each client") &
+			value("fraction", settings.divergence)),
+		(option("--sessions").doc(
+			"sessions per client") & value("sessions", settings.sessions)),
+		(option("--think-time").doc(
+			"pause between the sessions of a client in ms") &
+			value("ms", settings.think_time)),
+		option("--keep").set(keep).doc(
+			"leave the temporary trees in place"),
+		option("--verbose").set(verbose).doc(
+			"log additional debug info")
+	);
+
+	if (!parse(argc, argv, cli)) {
+		cout << make_man_page(cli, argv[0]);
+		return 0;
+	}
+
+	if (verbose) {
+		set_level(level_enum::debug);
+	}
+
+	if (client_counts.empty()) {
+		client_counts = {1, 10, 100};
+	}
+
+	char directory[]{"/tmp/dir_sync_loadgen.XXXXXX"};
+	loadgen_cleanup cleanup{"", keep, -1};
+
+	if (mkdtemp(directory) == nullptr) {
+		console->error("Could not create temporary directory.");
+		return errno;
+	}
+
+	cleanup.directory = directory;
+
+	if (chdir(directory) != 0) {
+		console->error("Could not enter temporary directory.");
+		return errno;
+	}
+
+	time_t mtime{time(nullptr) - 24 * 3600};
+
+	if (!write_master_tree(SERVER_DIRECTORY, settings, mtime) || 
+		!write_master_tree(CLIENT_DIRECTORY, settings, mtime)) {
+		console->error("Could not write tree.");
+		return errno;
+	}
+
+	if (server_path.empty()) {
+		char executable[4096]{};
+
+		if (readlink("/proc/self/exe", executable, sizeof(executable) - 1) < 0) {
+			console->error("Could not locate dir_sync_server, use --server.");
+			return errno;
+		}
+
+		server_path = string(executable);
+		server_path = server_path.substr(0, server_path.rfind('/') + 1) + 
+			"dir_sync_server";
+	}
+
+	pid_t server_pid{spawn_server(server_path, 
+		format("{}/{}", directory, SERVER_DIRECTORY), settings.port)};
+
+	cleanup.server_pid = server_pid;
+
+	if (server_pid < 0 || !wait_for_server(settings.port)) {
+		console->error("Could not start '{}'.", server_path);
+		return CONNECTION_COULD_NOT_BE_ESTABLISHED;
+	}
+
+	cout << format("{} files of {} B, divergence {:.2f}, {} session(s) per "
+		"client", settings.files, settings.file_size, settings.divergence,
+		settings.sessions) << endl;
+
+	cout << format("{:>8} {:>10} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10} "
+		"{:>10} {:>10}", "clients", "failed", "connect p99", "wait p50", 
+		"wait p99", "done p50", "done p90", "done p99", "MB/s", "RSS MiB") << endl;
+
+	for (unsigned int client_count : client_counts) {
+		// Every client works on a real tree of its own
+		vector<string> client_roots;
+		vector<int> client_fds;
+		bool prepared{write_master_tree(SERVER_DIRECTORY, settings, mtime)};
+
+		for (unsigned int i{0}; prepared && i < client_count; i++) {
+			client_roots.push_back(format("{}.{}.{}", CLIENT_DIRECTORY, 
+				client_count, i));
+			remove_tree(client_roots.back());
+			client_fds.push_back(create_client_tree(client_roots.back(), 
+				settings, mtime));
+			prepared = client_fds.back() >= 0;
+		}
+
+		if (!prepared) {
+			console->error("Could not write trees for {} clients.", client_count);
+			return errno;
+		}
+
+		vector<double> connect_times;
+		vector<double> wait_times;
+		vector<double> completion_times;
+		unsigned long long bytes{0};
+		unsigned int failed{0};
+		mutex results_mtx;
+
+		atomic<bool> sampling{true};
+		atomic<unsigned long long> peak_rss{0};
+
+		thread sampler{[&]() {
+			while (sampling) {
+				peak_rss = max<unsigned long long>(peak_rss,
+					resident_set_size(server_pid));
+				std::this_thread::sleep_for(milliseconds(10));
+			}
+		}};
+
+		steady_clock::time_point start{steady_clock::now()};
+		vector<thread> clients;
+
+		for (unsigned int i{0}; i < client_count; i++) {
+			clients.emplace_back([&, i]() {
+				vector<Divergence> divergences{client_divergences(settings, i)};
+
+				for (unsigned int session{0}; session < settings.sessions; session++) {
+					if (session > 0) {
+						std::this_thread::sleep_for(milliseconds(settings.think_time));
+					}
+
+					session_result result{};
+
+					if (diverge_client_tree(client_fds[i], divergences, settings, 
+						mtime)) {
+						result = run_session(settings, client_fds[i]);
+					}
+
+					lock_guard<mutex> guard{results_mtx};
+
+					if (result.completed) {
+						connect_times.push_back(result.connect_time);
+						wait_times.push_back(result.wait_time);
+						completion_times.push_back(result.completion_time);
+						bytes += result.bytes;
+					} else {
+						failed++;
+					}
+				}
+			});
+		}
+
+		for (thread& client : clients) {
+			client.join();
+		}
+
+		double seconds{duration<double>(steady_clock::now() - start).count()};
+
+		sampling = false;
+		sampler.join();
+
+		cout << format("{:>8} {:>10} {:>12.3f} {:>10.3f} {:>10.3f} {:>10.3f} "
+			"{:>10.3f} {:>10.3f} {:>10.1f} {:>10.1f}", client_count, failed,
+			percentile(connect_times, 0.99), percentile(wait_times, 0.5), 
+			percentile(wait_times, 0.99), percentile(completion_times, 0.5), 
+			percentile(completion_times, 0.9), percentile(completion_times, 0.99), 
+			bytes / seconds / 1e6, peak_rss / 1024.0) << endl;
+
+		for (unsigned int i{0}; i < client_fds.size(); i++) {
+			close(client_fds[i]);
+
+			if (!keep) {
+				remove_tree(client_roots[i]);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include <errno.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wconversion"
+
+#include "spdlog/spdlog.h"
+#include "fmt/format.h"
+#include "json.hpp"
+#include "clipp.h"
+
+#pragma GCC diagnostic pop
+
+#include "dir_sync.pb.h"
+
+#include "local_sync.h"
+#include "constants.h"
+#include "trace.h"
+
+using std::cout;
+
+using std::string;
+using std::vector;
+using std::ifstream;
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+using spdlog::stdout_color_mt;
+using spdlog::set_level;
+using spdlog::level::level_enum;
+
+using nlohmann::json;
+
+using namespace clipp;
+
+auto console{stdout_color_mt("local_sync")};
+
+int main(int argc, char* argv[]) {
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+	string first;
+	string second;
+	string config;
+
+	bool verbose{false};
+	vector<string> filter_rules;
+	unsigned int workers{DEFAULT_LOCAL_WORKERS};
+	bool dry_run{false};
+	bool strict{false};
+	string trace;
+
+	auto cli = (
+		value("first", first),
+		value("second", second),
+		option("--verbose").set(verbose).doc(
+			"log additional debug info"),
+		(option("-c", "--config").doc(
+			"override command line parameters with config") & value(
+			"config", config)),
+		repeatable(option("-x", "--exclude").doc(
+			"exclude paths matching a gitignore-style pattern") &
+			value("pattern", filter_rules)),
+		repeatable(option("-i", "--include").doc(
+			"re-include excluded paths matching a pattern") &
+			value("pattern").call([&](const char* pattern) {
+				filter_rules.push_back(string("!") + pattern);
+			})),
+		(option("-j", "--workers").doc(
+			"files copied in parallel") & value("workers", workers)),
+		option("--dry-run").set(dry_run).doc(
+			"print planned copies without changing anything"),
+		option("--strict").set(strict).doc(
+			"hash every file instead of comparing size and mtime"),
+		(option("--trace").doc(
+			"write a Chrome trace of the sync (needs a build with "
+			"-DDIR_SYNC_TRACE=ON)") & value("trace", trace))
+	);
+
+	if (!parse(argc, argv, cli)) {
+		cout << make_man_page(cli, argv[0]);
+		return 0;
+	}
+
+	if (config != "") {
+		ifstream config_file(config);
+
+		if (config_file.good()) {
+			json j;
+			config_file >> j;
+
+			verbose = j.value("verbose", verbose);
+
+			for (const string& pattern : j.value("exclude", vector<string>{})) {
+				filter_rules.push_back(pattern);
+			}
+			for (const string& pattern : j.value("include", vector<string>{})) {
+				filter_rules.push_back("!" + pattern);
+			}
+			workers = j.value("workers", workers);
+			dry_run = j.value("dry_run", dry_run);
+			strict = j.value("strict", strict);
+			trace = j.value("trace", trace);
+
+			console->info("Config file '{}' applied.", config);
+		} else {
+			console->warn("Config file '{}' could not be applied.", config);
+		}
+	}
+
+	if (verbose) {
+		set_level(level_enum::debug);
+	}
+
+	if (!trace.empty() && !TRACE_AVAILABLE) {
+		console->warn("Tracing is not compiled in, rebuild with "
+			"-DDIR_SYNC_TRACE=ON.");
+	} else if (!trace.empty()) {
+		enable_trace(trace);
+		TRACE_THREAD_NAME("local_sync");
+	}
+
+	local_sync_options options;
+	options.workers = workers;
+	options.dry_run = dry_run;
+	options.strict = strict;
+
+	for (const string& rule : filter_rules) {
+		options.filter.add_rule(rule);
+	}
+
+	local_sync_result result;
+	steady_clock::time_point start{steady_clock::now()};
+
+	if (!sync_local(first, second, options, result)) {
+		console->error("Could not open '{}' or '{}'.", first, second);
+		return ENOENT;
+	}
+
+	console->info("Created {} directories, copied {} files ({:.1f} MiB) in "
+		"{:.3f} s, {} failed.", result.directories, result.files,
+		result.bytes / (1024.0 * 1024),
+		duration<double>(steady_clock::now() - start).count(), result.failed);
+
+	if (trace_enabled() && !dump_trace()) {
+		console->warn("Could not write trace.");
+	}
+
+	return result.failed > 0 ? LOCAL_SYNC_INCOMPLETE : 0;
+}
@@ -3,8 +3,15 @@
 #include <string>
 #include <tuple>
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <deque>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <sys/stat.h> 
 
@@ -25,11 +32,25 @@
 #include "shared.h"
 #include "constants.h"
 #include "networking.h"
+#include "transfer_plan.h"
+#include "tree_diff.h"
+#include "tls.h"
+#include "journal.h"
+#include "trace.h"
 
 using std::cout;
 
 using std::vector;
-using std::tuple;
+using std::unordered_map;
+using std::unordered_set;
+using std::thread;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::unique_ptr;
+using std::deque;
+using std::move;
+using std::atomic;
 
 using std::get;
 
@@ -45,107 +66,624 @@ using spdlog::set_level;
 using spdlog::level::level_enum;
 
 using dir_sync::FileMetadata;
-using dir_sync::DirectoryMetadata;
+
+using fmt::format;
 
 using nlohmann::json;
 
 using namespace clipp;
 
-typedef tuple<vector<string>, vector<string>> file_tree_file_diff;
-typedef vector<string> file_tree_dir_diff;
-
 auto console{stdout_color_mt("server")};
 
-file_tree_file_diff diff_file_tree_files(
-	FileTree& master_tree, FileTree& slave_tree) {
+// Sessions served at once
+const unsigned int DEFAULT_SESSION_WORKERS{4};
+// FileHash requests sent ahead of their replies
+const unsigned int MAX_PENDING_HASHES{64};
+
+struct pending_session;
+
+// Directory served under a name. Every file operation is relative to its 
+// descriptor, the working directory of the process is never changed.
+struct sync_root {
+	string path;
+	int fd;
+	string server_id;
+	SyncJournal journal;
+	// Sessions of one root run one after another, those arriving while one 
+	// runs wait in the queue without holding a worker
+	mutex queue_mtx;
+	bool busy;
+	deque<unique_ptr<pending_session>> queue;
+};
+
+// Session that has been handshaken and waits for its root
+struct pending_session {
+	// Numbers sessions in logs and trace files
+	unsigned long long id;
+	// Outlives the socket, which is closed first
+	unique_ptr<TlsSession> tls_session;
+	tcp::socket sock;
+	string ip_address;
+	unsigned short port;
+	link_estimate link;
+	bool zero_copy;
+	string root_name;
+	sync_root* root;
+};
+
+// Shared by all sessions of the process
+struct server_context {
+	// The default root is named ""
+	unordered_map<string, unique_ptr<sync_root>> roots;
+	PathFilter path_filter;
+	// Clients requesting the same files are served from memory, across roots
+	PartCache* part_cache;
+	SSL_CTX* tls_ctx;
+	double bandwidth;
+	// Quick checked trees are scanned without hashing
+	bool strict;
+	bool dry_run;
+	bool zero_copy;
+	bool verbose;
+	// Received files are written by a pool per session
+	unsigned int writers;
+	unsigned long long write_buffer_size;
+	atomic<unsigned long long> sessions;
+};
+
+int send_file_request(Multiplexer& mux, string relative_path) {
+	FileRequest file_request;
+	file_request.set_relative_path(relative_path);
 
-	vector<string> file_sends;
-	vector<string> file_requests;
+	return mux.send(Stream::Control, file_request);
+}
 
-	string cur_master_file_path;	
-	string cur_slave_file_path;	
 
-	for (const FileMetadata& master_file : master_tree.files()) {
-		bool in_slave{false};
-		cur_master_file_path = master_file.relative_path();
+// Answers the client's SyncGeneration and receives its tree, which only 
+// holds changes if both peers journaled the same generation. record is 
+// filled with what has to be journaled after the session (if anything).
+int recv_slave_file_tree(Multiplexer& mux, const SyncJournal& journal, 
+	const string& server_id, FileTree& slave_file_tree, JournalRecord& record) {
+	SyncGeneration client_generation;
 
-		for (const FileMetadata& slave_file : slave_tree.files()) {
-			cur_slave_file_path = slave_file.relative_path();
+	if (mux.recv(Stream::Control, client_generation) != PROTO_TYPE_OK) {
+		return PROTO_TYPE_WRONG;
+	}
 
-			if (slave_file.relative_path() == master_file.relative_path()) {
-				in_slave = true;
+	const string& client_id{client_generation.peer_id()};
+	JournalRecord known;
+	bool journaled{!server_id.empty() && journal.load(client_id, known)};
 
-				if (slave_file.hash() != master_file.hash()) {
-					if (slave_file.mtime() < master_file.mtime())  {
-						// Send file
-						file_sends.push_back(cur_slave_file_path);
-					} else if (slave_file.mtime() > master_file.mtime()) {
-						// Request file
-						file_requests.push_back(cur_slave_file_path);
-					}
-				}
-			}
+	SyncGeneration server_generation;
+	server_generation.set_peer_id(server_id);
+	server_generation.set_generation(journaled ? known.generation() : 0);
+
+	// Updated along with the client's changes, computed for full trees
+	string digest;
+
+	if (journaled) {
+		digest = record_digest(known);
+		server_generation.set_digest(digest);
+	}
+	FileTree file_tree;
+
+	if (mux.send(Stream::Control, server_generation) > 0 || 
+		mux.recv(Stream::Control, file_tree) != PROTO_TYPE_OK) {
+		return PROTO_TYPE_WRONG;
+	}
+
+	// Only set if the client journals the session as well
+	unsigned long long generation{file_tree.generation()};
+
+	if (file_tree.has_base_generation()) {
+		if (!journaled || file_tree.base_generation() != known.generation()) {
+			console->error("Client sent changes relative to unknown generation "
+				"{}.", file_tree.base_generation());
+			return PROTO_TYPE_WRONG;
 		}
 
-		if (!in_slave) {
-			// Send file
-			file_sends.push_back(cur_master_file_path);
+		console->debug("Applying {} changed, {} removed files of generation {}.", 
+			file_tree.files_size(), file_tree.removed_files_size(), 
+			file_tree.base_generation());
+
+		slave_file_tree = apply_tree_delta(known.tree(), file_tree, &digest);
+	} else {
+		slave_file_tree.Swap(&file_tree);
+		slave_file_tree.clear_generation();
+		digest.clear();
+	}
+
+	record.Clear();
+
+	if (!server_id.empty() && valid_peer_id(client_id) && generation > 0) {
+		record.set_peer_id(client_id);
+		record.set_generation(generation);
+		*record.mutable_tree() = slave_file_tree;
+		record.set_digest(digest.empty() ? tree_digest(slave_file_tree) : digest);
+	}
+
+	return PROTO_TYPE_OK;
+}
+
+// Hashes files whose size and mtime don't tell if they differ, the client 
+// hashes its copies of them on request
+int resolve_ambiguous_files(Multiplexer& mux, int root_fd, 
+	FileTree& master_file_tree, FileTree& slave_file_tree) {
+	vector<string> ambiguous{ambiguous_files(master_file_tree, slave_file_tree)};
+
+	if (ambiguous.empty()) {
+		return PROTO_TYPE_OK;
+	}
+
+	console->debug("Hashing {} files with ambiguous metadata.", 
+		ambiguous.size());
+
+	unordered_set<string> ambiguous_paths(ambiguous.begin(), ambiguous.end());
+	unordered_map<string, FileMetadata*> slave_files;
+	vector<const string*> requests;
+	FileHash file_hash;
+
+	for (FileMetadata& slave_file : *slave_file_tree.mutable_files()) {
+		if (slave_file.hash().empty() && 
+			ambiguous_paths.count(slave_file.relative_path()) > 0) {
+			slave_files[slave_file.relative_path()] = &slave_file;
+			requests.push_back(&slave_file.relative_path());
 		}
 	}
 
-	// Request files that are in slave tree but not in master tree
-	for (const FileMetadata& slave_file : slave_tree.files()) {
-		bool in_master{false};
-		cur_slave_file_path = slave_file.relative_path();
+	size_t sent{0};
 
-		for (const FileMetadata& master_file : master_tree.files()) {
-			if (slave_file.relative_path() == master_file.relative_path()) {
-				in_master = true;
-			}
+	auto send_request{[&]() {
+		file_hash.Clear();
+		file_hash.set_relative_path(*requests[sent++]);
+
+		return mux.send(Stream::Control, file_hash);
+	}};
+
+	// Nobody reads replies while requests are sent, only a window of them 
+	// is in flight so neither socket buffer fills up
+	while (sent < requests.size() && sent < MAX_PENDING_HASHES) {
+		if (send_request() > 0) {
+			return PROTO_TYPE_WRONG;
+		}
+	}
+
+	// Both ends hash at the same time
+	hash_files(master_file_tree, ambiguous, root_fd);
+
+	for (size_t received{0}; received < requests.size(); received++) {
+		if (mux.recv(Stream::Control, file_hash) != PROTO_TYPE_OK) {
+			return PROTO_TYPE_WRONG;
+		}
+
+		auto slave_file = slave_files.find(file_hash.relative_path());
+
+		if (slave_file != slave_files.end()) {
+			slave_file->second->set_hash(file_hash.hash());
+		}
+
+		if (sent < requests.size() && send_request() > 0) {
+			return PROTO_TYPE_WRONG;
 		}
+	}
+
+	// Only the mtimes differ, the client's copies take the server's so the 
+	// next quick check passes without hashing. The journal still holds the 
+	// old mtimes, the client's next delta carries the new ones.
+	for (const FileMetadata* master_file : identical_files(master_file_tree, 
+		slave_file_tree)) {
+		auto slave_file = slave_files.find(master_file->relative_path());
+
+		// Strict clients hashed the file on their own
+		if (slave_file == slave_files.end()) {
+			continue;
+		}
+
+		file_hash.Clear();
+		file_hash.set_relative_path(master_file->relative_path());
+		file_hash.set_hash(master_file->hash());
+		file_hash.set_mtime(master_file->mtime());
+
+		if (mux.send(Stream::Control, file_hash) > 0) {
+			return PROTO_TYPE_WRONG;
+		}
+
+		slave_file->second->set_mtime(master_file->mtime());
+	}
+
+	return PROTO_TYPE_OK;
+}
+
+// Opens path as the root called name. 0 or the errno of open().
+int add_root(server_context& context, const string& name, const string& path) {
+	if (context.roots.count(name) > 0) {
+		console->error("Root '{}' is defined more than once.", name);
+		return EEXIST;
+	}
+
+	int fd{open(path.c_str(), O_RDONLY | O_DIRECTORY)};
+
+	if (fd < 0) {
+		int error{errno};
+		console->error("Could not open root '{}' ({}): {}", name, path, 
+			repr_chdir_error(error));
+		return error;
+	}
+
+	context.roots[name] = unique_ptr<sync_root>(new sync_root{path, fd, 
+		local_peer_id(fd), SyncJournal{fd}, {}, false, {}});
+
+	return 0;
+}
+
+// Handshakes a connection: TLS, sanity check and link measurement. The 
+// socket is taken over, nullptr (and the socket closed) on failure.
+unique_ptr<pending_session> start_session(tcp::socket& sock, 
+	server_context& context, unsigned long long id) {
+	error_code error_code_;
+	tcp::endpoint endpoint{sock.remote_endpoint(error_code_)};
+
+	string ip_address{endpoint.address().to_string()};
+	unsigned short port{endpoint.port()};
+
+	console->info("Connection established ({}:{}).", ip_address, port);
 
-		if (!in_master) {
-			// Request file
-			file_requests.push_back(cur_slave_file_path);
+	// Every path below closes the socket before the TLS session ends
+	unique_ptr<TlsSession> tls_session{new TlsSession};
+	bool session_zero_copy{context.zero_copy};
+
+	if (context.tls_ctx != nullptr) {
+		if (tls_session->start(sock, context.tls_ctx, true) != TLS_OK) {
+			console->error("TLS handshake with '{}:{}' failed.", 
+				ip_address, port);
+			sock.close();
+			return nullptr;
 		}
+
+		console->debug("Encryption: {}", 
+			repr_tls_session(tls_session.get()));
+
+		// Only the kernel can encrypt data that never enters userspace
+		session_zero_copy = context.zero_copy && tls_session->kernel_send();
 	}
 
-	return {file_sends, file_requests};
+	// Both are sock itself unless TLS is relayed in userspace
+	tcp::socket& read_sock{tls_session->reader(sock)};
+	int tcp_fd{tls_session->network_fd(sock)};
+
+	SanityCheck sanity_check;
+
+	if (recv_proto(read_sock, sanity_check) != PROTO_TYPE_OK) {
+		console->error("Unexpected message type ({}:{}). "
+			"Closing connection.", ip_address, port);
+
+		sock.close();
+		return nullptr;
+	}
+
+	auto root_ = context.roots.find(sanity_check.root());
+
+	if (root_ == context.roots.end()) {
+		console->error("Unknown root '{}' ({}:{}). Closing connection.", 
+			sanity_check.root(), ip_address, port);
+
+		sock.close();
+		return nullptr;
+	}
+
+	if (!is_sane(sanity_check)) {
+		console->error("Sanity check failed, "
+			"prepare for unforseen consequences.");
+	} else {
+		console->debug("Client is sane.");
+	}
+
+	link_estimate link{0, 0};
+
+	if (probe_link(sock, read_sock, tcp_fd, link) > 0) {
+		console->warn("Could not measure link.");
+	}
+
+	// Configured bandwidth takes precedence over the measurement
+	if (context.bandwidth > 0) {
+		link.throughput = context.bandwidth * 1e6 / 8;
+	}
+
+	tune_socket(tcp_fd, link);
+
+	return unique_ptr<pending_session>(new pending_session{id, 
+		move(tls_session), move(sock), ip_address, port, link, 
+		session_zero_copy, root_->first, root_->second.get()});
 }
 
-file_tree_dir_diff diff_file_tree_directories(
-	FileTree& master_tree, FileTree& slave_tree) {
+// Serves a handshaken session and closes its connection
+void run_session(pending_session& session, server_context& context) {
+	tcp::socket& sock{session.sock};
+	tcp::socket& read_sock{session.tls_session->reader(sock)};
+	int tcp_fd{session.tls_session->network_fd(sock)};
+
+	const string& ip_address{session.ip_address};
+	unsigned short port{session.port};
+	const link_estimate& link{session.link};
+	bool session_zero_copy{session.zero_copy};
+	sync_root& root{*session.root};
+
+	// Follows the link while files are sent, a configured bandwidth is kept
+	PartSizer part_sizer{context.bandwidth > 0 ? -1 : tcp_fd, link};
+	unsigned int part_size{part_sizer.largest()};
+
+	console->debug("Part size: {} B", part_size);
+	console->debug("Serving root '{}' ({}).", session.root_name, root.path);
+
+	FileTree master_file_tree{get_file_tree(root.fd, context.path_filter, 
+		context.strict)};
+	FileTree slave_file_tree;
+
+	Multiplexer mux{sock, read_sock};
+	JournalRecord journal_record;
+
+	if (recv_slave_file_tree(mux, root.journal, root.server_id, 
+		slave_file_tree, journal_record) == PROTO_TYPE_OK) {
+		console->debug("File tree received.");
+
+		// Paths excluded here are neither sent nor requested
+		filter_file_tree(slave_file_tree, context.path_filter);
+
+		if (resolve_ambiguous_files(mux, root.fd, master_file_tree, 
+			slave_file_tree) != PROTO_TYPE_OK) {
+			console->error("Could not hash ambiguous files ({}:{}). "
+				"Closing connection.", ip_address, port);
 
-	vector<string> folder_requests;
+			sock.close();
+			return;
+		}
+
+		file_tree_file_diff file_tree_file_diff_{
+			diff_file_tree_files(
+				master_file_tree, slave_file_tree)};
+
+		file_tree_dir_diff file_tree_dir_diff_server{
+			diff_file_tree_directories(
+				master_file_tree, slave_file_tree)};
+
+		file_tree_dir_diff file_tree_dir_diff_client{
+			diff_file_tree_directories(
+				slave_file_tree, master_file_tree)};	
+
+		console->debug("Files slated for send: ");
+		print_string_vector(get<0>(file_tree_file_diff_), context.verbose);
+
+		console->debug("File requests: ");
+		print_string_vector(get<1>(file_tree_file_diff_), context.verbose);
+
+		console->debug("Directory creation requests: ");
+		print_string_vector(file_tree_dir_diff_server, context.verbose);
 
-	string cur_master_dir_path;
+		console->debug("Creating directories: ");
+		print_string_vector(file_tree_dir_diff_client, context.verbose);
 
-	for (const DirectoryMetadata& master_dir : master_tree.directories()) {
-		bool in_slave{false};
-		cur_master_dir_path = master_dir.relative_path();
+		transfer_plan send_plan{plan_sends(
+			get<0>(file_tree_file_diff_), master_file_tree, 
+			slave_file_tree, link, root.fd)};
+		transfer_plan request_plan{plan_requests(
+			get<1>(file_tree_file_diff_), master_file_tree, 
+			slave_file_tree, link)};
 
-		for (const DirectoryMetadata& slave_dir : slave_tree.directories()) {
-			if (slave_dir.relative_path() == master_dir.relative_path()) {
-				in_slave = true;
+		if (context.dry_run) {
+			print_transfer_plan(send_plan, "Planned sends:");
+			print_transfer_plan(request_plan, "Planned requests:");
+
+			// The session runs with empty stages, the client 
+			// doesn't change anything either
+			file_tree_dir_diff_server.clear();
+			file_tree_dir_diff_client.clear();
+			send_plan.clear();
+			request_plan.clear();
+		}
+
+		// Create folders that exist on client but not on server
+
+		for (const string& dir_path : file_tree_dir_diff_client) {
+			if (mkdirat(root.fd, dir_path.c_str(), 
+				S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) > 0) {
+				console->warn("Could not create directory '{}'.", 
+					dir_path);
 			}
 		}
 
-		if (!in_slave) {
-			// Request folder creation
-			folder_requests.push_back(cur_master_dir_path);
+		// The control stream goes first, the client needs it before 
+		// it can receive or upload anything
+		set_cork(tcp_fd, true);
+
+		// Request folder creation of folders that are missing on the client
+
+		for (const string& dir_path : file_tree_dir_diff_server) {
+			if (send_directory(mux, dir_path) > 0) {
+				console->warn("Could not request directory creation "
+					"for '{}'.", dir_path);
+			}
+		}
+
+		send_protocol_separator(mux, Stream::Control);
+
+		// Request files that are missing on the server, identical 
+		// local files are copied instead. Nothing else is accepted.
+
+		unordered_set<string> requested_paths;
+
+		for (const planned_transfer& planned : request_plan) {
+			if (planned.strategy == TransferStrategy::LocalCopy) {
+				continue;
+			}
+
+			requested_paths.insert(planned.relative_path);
+
+			if (send_file_request(mux, planned.relative_path) > 0) {
+				console->warn("Could not request file "
+					"'{}'.", planned.relative_path);
+			}
 		}
+
+		send_protocol_separator(mux, Stream::Control);
+		set_cork(tcp_fd, false);
+
+		// Send files that are missing on the client while the 
+		// requested ones are received
+
+		unordered_map<string, const FileMetadata*> master_files;
+
+		for (const FileMetadata& master_file : master_file_tree.files()) {
+			master_files[master_file.relative_path()] = &master_file;
+		}
+
+		bool sent{true};
+
+		thread sender{[&]() {
+			TRACE_THREAD_NAME("sender");
+			TRACE_SESSION(session.id);
+
+			// Only parts of these are resent on request
+			unordered_set<string> sent_paths;
+
+			set_cork(tcp_fd, true);
+
+			for (const planned_transfer& planned : send_plan) {
+				const FileMetadata* master_file{
+					master_files[planned.relative_path]};
+				int send_error_code{};
+
+				if (planned.strategy == TransferStrategy::LocalCopy) {
+					send_error_code = send_file_copy(mux, 
+						planned.relative_path, planned.copy_from, 
+						master_file->mtime());
+				} else {
+					sent_paths.insert(planned.relative_path);
+					send_error_code = send_file(mux, 
+						planned.relative_path, {context.part_cache, 
+						master_file->hash(), 
+						planned.strategy == TransferStrategy::Compressed, 
+						part_size, session_zero_copy, root.fd, &part_sizer});
+				}
+
+				if (send_error_code > 0) {
+					console->warn("Could not send file "
+						"'{}'.", planned.relative_path);
+				}
+			}
+
+			send_protocol_separator(mux, Stream::Files);
+			set_cork(tcp_fd, false);
+
+			// Resend parts the client could not verify
+
+			if (serve_chunk_requests(mux, sent_paths, part_sizer.largest(), 
+				root.fd) > 0) {
+				console->warn("Could not resend damaged file parts.");
+				sent = false;
+			}
+		}};
+
+		unordered_map<string, time_t> slave_mtimes;
+
+		for (const FileMetadata& slave_file : slave_file_tree.files()) {
+			slave_mtimes[slave_file.relative_path()] = slave_file.mtime();
+		}
+
+		for (const planned_transfer& planned : request_plan) {
+			if (planned.strategy == TransferStrategy::LocalCopy && 
+				(!copy_local_file(planned.copy_from, 
+				planned.relative_path, root.fd) || 
+				!set_mtime(slave_mtimes[planned.relative_path], 
+				planned.relative_path, root.fd))) {
+				console->warn("Could not copy '{}' to '{}'.", 
+					planned.copy_from, planned.relative_path);
+			}
+		}
+
+		// Receive files
+
+		// Copies are planned here, the client never sends any
+		bool received{recv_files(mux, {root.fd, context.writers, 
+			context.write_buffer_size, false, &requested_paths}) == 
+			FILE_RECV_OK};
+
+		if (!received) {
+			console->warn("Could not receive all requested files.");
+
+			// Unblocks the sender
+			mux.shutdown();
+		}
+
+		sender.join();
+		sock.close();
+
+		// The client journals the same record once it's done
+		if (received && sent && journal_record.has_peer_id() && 
+			!root.journal.store(journal_record)) {
+			console->warn("Could not journal session.");
+		}
+	} else {
+		console->error("Could not receive file tree ({}:{}). "
+			"Closing connection.", ip_address, port);
+
+		sock.close();
 	}
+}
 
-	return folder_requests;
+// Events of other sessions are kept for their own dump
+void dump_session_trace(unsigned long long session) {
+	if (trace_enabled() && !dump_trace(format(".{}", session), session)) {
+		console->warn("Could not write trace of session {}.", session);
+	}
 }
 
-int send_file_request(tcp::socket& sock, string relative_path) {
-	FileRequest file_request;
-	file_request.set_relative_path(relative_path);
+// Runs a session on an accepted connection. Sessions of a root that is 
+// being served are queued, the worker serving it runs them afterwards and 
+// this one goes back to accepting.
+void serve_session(tcp::socket& sock, server_context& context) {
+	unsigned long long id{++context.sessions};
 
-	return send_proto(sock, file_request);
-}
+	TRACE_SESSION(id);
+
+	unique_ptr<pending_session> session{start_session(sock, context, id)};
 
+	if (!session) {
+		dump_session_trace(id);
+		return;
+	}
+
+	sync_root& root{*session->root};
+
+	{
+		lock_guard<mutex> queue_guard{root.queue_mtx};
+
+		if (root.busy) {
+			console->debug("Root '{}' is busy, session of {}:{} queued.", 
+				session->root_name, session->ip_address, session->port);
+
+			root.queue.push_back(move(session));
+			return;
+		}
+		root.busy = true;
+	}
+
+	while (session) {
+		TRACE_SESSION(session->id);
+
+		run_session(*session, context);
+		dump_session_trace(session->id);
+
+		lock_guard<mutex> queue_guard{root.queue_mtx};
+
+		if (root.queue.empty()) {
+			root.busy = false;
+			session.reset();
+		} else {
+			session = move(root.queue.front());
+			root.queue.pop_front();
+		}
+	}
+}
 
 int main(int argc, char* argv[]) {
 	GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -156,19 +694,70 @@ int main(int argc, char* argv[]) {
 	unsigned short port{default_port};
 	bool strict{false};
 	bool verbose{false};
-	
+	vector<string> filter_rules;
+	unsigned long long cache_size{DEFAULT_PART_CACHE_SIZE / (1024 * 1024)};
+	double bandwidth{0};
+	bool dry_run{false};
+	string tls_cert;
+	string tls_key;
+	bool zero_copy{false};
+	string trace;
+	vector<string> root_specs;
+	unsigned int session_workers{DEFAULT_SESSION_WORKERS};
+	unsigned int writers{DEFAULT_WRITERS};
+	unsigned long long write_buffer_size{
+		DEFAULT_WRITE_BUFFER_SIZE / (1024 * 1024)};
 
 	auto cli = (
-		value("directory", directory),
+		opt_value("directory", directory),
 		option("--strict").set(strict).doc(
-			"compare hashes and file metadata"),
+			"hash every file instead of comparing size and mtime"),
 		option("--verbose").set(verbose).doc(
 			"log additional debug info"),
 		(option("-p", "--port").doc(
 			"provide alternative port") & value("port", port)),
 		(option("-c", "--config").doc(
 			"override command line parameters with config") & value(
-			"config", config))
+			"config", config)),
+		repeatable(option("-x", "--exclude").doc(
+			"exclude paths matching a gitignore-style pattern") & 
+			value("pattern", filter_rules)),
+		repeatable(option("-i", "--include").doc(
+			"re-include excluded paths matching a pattern") & 
+			value("pattern").call([&](const char* pattern) {
+				filter_rules.push_back(string("!") + pattern);
+			})),
+		(option("--cache-size").doc(
+			"memory budget of the file part cache in MiB (0 disables it)") & 
+			value("cache_size", cache_size)),
+		(option("--bandwidth").doc(
+			"link throughput in Mbit/s (measured if omitted)") & 
+			value("bandwidth", bandwidth)),
+		option("--dry-run").set(dry_run).doc(
+			"print predicted transfers without changing anything"),
+		(option("--tls-cert").doc(
+			"certificate chain (PEM), enables encryption") & 
+			value("tls_cert", tls_cert)),
+		(option("--tls-key").doc(
+			"private key (PEM) of the certificate") & value("tls_key", tls_key)),
+		option("--zero-copy").set(zero_copy).doc(
+			"send files with sendfile() on plaintext connections, bypasses the "
+			"part cache"),
+		(option("--trace").doc(
+			"write a Chrome trace of every session to <trace>.<n> (needs a "
+			"build with -DDIR_SYNC_TRACE=ON)") & value("trace", trace)),
+		repeatable(option("-r", "--root").doc(
+			"serve another directory under a name, clients pick it with "
+			"--root") & value("name=path", root_specs)),
+		(option("--sessions").doc(
+			"sessions served at once, one at a time per root") & 
+			value("sessions", session_workers)),
+		(option("--writers").doc(
+			"threads writing received files of a session") & 
+			value("writers", writers)),
+		(option("--write-buffer").doc(
+			"memory budget of received parts waiting to be written in MiB") & 
+			value("write_buffer", write_buffer_size))
 	);
 
 	if (!parse(argc, argv, cli)) {
@@ -185,6 +774,30 @@ int main(int argc, char* argv[]) {
 				verbose = j.value("verbose", verbose);
 				port = j.value("port", port);
 
+				for (const string& pattern : j.value("exclude", vector<string>{})) {
+					filter_rules.push_back(pattern);
+				}
+				for (const string& pattern : j.value("include", vector<string>{})) {
+					filter_rules.push_back("!" + pattern);
+				}
+				cache_size = j.value("cache_size", cache_size);
+				bandwidth = j.value("bandwidth", bandwidth);
+				dry_run = j.value("dry_run", dry_run);
+				tls_cert = j.value("tls_cert", tls_cert);
+				tls_key = j.value("tls_key", tls_key);
+				zero_copy = j.value("zero_copy", zero_copy);
+				trace = j.value("trace", trace);
+
+				json roots(j.value("roots", json::object()));
+
+				for (auto root = roots.begin(); root != roots.end(); root++) {
+					root_specs.push_back(root.key() + "=" + 
+						root.value().get<string>());
+				}
+				session_workers = j.value("sessions", session_workers);
+				writers = j.value("writers", writers);
+				write_buffer_size = j.value("write_buffer", write_buffer_size);
+
 				console->info("Config file '{}' applied.", config);
 			} else {
 				console->warn("Config file '{}' could not be applied.", 
@@ -196,133 +809,99 @@ int main(int argc, char* argv[]) {
 			set_level(level_enum::debug);
 		}
 
-		if (chdir(directory.c_str()) == 0) {
-			
-			io_context ctx;
-			error_code error_code_;
-
-			tcp::acceptor acceptor{ctx, tcp::endpoint{tcp::v4(), port}};
-
-			while (true) {
-				tcp::socket sock{acceptor.accept(error_code_)};
-				tcp::endpoint endpoint{sock.remote_endpoint()};
-
-				string ip_address{endpoint.address().to_string()};
-				unsigned short port{endpoint.port()};
-
-				if (error_code_) {
-					console->error("Connection with '{}:{}' could not be "
-						"established. ({})", ip_address, port, error_code_.message());
-					sock.close();
-				} else {
-					console->info("Connection established ({}:{}).", ip_address, 
-						port);						
-
-					SanityCheck sanity_check;
-
-					if (recv_proto(sock, sanity_check) == PROTO_TYPE_OK) {
-						if (!is_sane(sanity_check)) {
-							console->error("Sanity check failed, "
-								"prepare for unforseen consequences.");
-						} else {
-							console->debug("Client is sane.");
-						}
-
-						FileTree master_file_tree{get_file_tree(".")};
-						FileTree slave_file_tree;
-
-						if (recv_proto(sock, slave_file_tree) == PROTO_TYPE_OK) {
-							console->debug("File tree received.");
-
-							file_tree_file_diff file_tree_file_diff_{
-								diff_file_tree_files(
-									master_file_tree, slave_file_tree)};
-
-							file_tree_dir_diff file_tree_dir_diff_server{
-								diff_file_tree_directories(
-									master_file_tree, slave_file_tree)};
-
-							file_tree_dir_diff file_tree_dir_diff_client{
-								diff_file_tree_directories(
-									slave_file_tree, master_file_tree)};	
-
-							console->debug("Files slated for send: ");
-							print_string_vector(get<0>(file_tree_file_diff_), verbose);
-
-							console->debug("File requests: ");
-							print_string_vector(get<1>(file_tree_file_diff_), verbose);
+		if (!trace.empty() && !TRACE_AVAILABLE) {
+			console->warn("Tracing is not compiled in, rebuild with "
+				"-DDIR_SYNC_TRACE=ON.");
+		} else if (!trace.empty()) {
+			enable_trace(trace);
+			TRACE_THREAD_NAME("server");
+		}
 
-							console->debug("Directory creation requests: ");
-							print_string_vector(file_tree_dir_diff_server, verbose);
+		// Shared between sessions, clients requesting the same files 
+		// are served from memory
+		PartCache part_cache{cache_size * 1024 * 1024};
 
-							console->debug("Creating directories: ");
-							print_string_vector(file_tree_dir_diff_client, verbose);
+		server_context context{{}, {}, &part_cache, nullptr, bandwidth, 
+			strict, dry_run, zero_copy, verbose, writers, 
+			write_buffer_size * 1024 * 1024, {0}};
 
-							// Create folders that exist on client but not on server
+		for (const string& rule : filter_rules) {
+			context.path_filter.add_rule(rule);
+		}
 
-							for (const string& dir_path : file_tree_dir_diff_client) {
-								if (mkdir(dir_path.c_str(), 
-									S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) > 0) {
-									console->warn("Could not create directory '{}'.", 
-										dir_path);
-								}
-							}
+		if (!tls_cert.empty()) {
+			context.tls_ctx = create_tls_server_context(tls_cert, 
+				tls_key.empty() ? tls_cert : tls_key);
 
-							// Request folder creation of folders that are missing on the client
+			if (context.tls_ctx == nullptr) {
+				return TLS_CONTEXT_ERR;
+			}
+		}
 
-							for (const string& dir_path : file_tree_dir_diff_server) {
-								if (send_directory(sock, dir_path) > 0) {
-									console->warn("Could not request directory creation "
-										"for '{}'.", dir_path);
-								}
-							}
+		if (directory.empty() && root_specs.empty()) {
+			console->error("Neither a directory nor a root to serve.");
+			return EINVAL;
+		}
 
-							send_protocol_separator(sock);
+		int root_error{directory.empty() ? 0 : 
+			add_root(context, "", directory)};
 
-							// Send files that are missing on the client
+		for (const string& root_spec : root_specs) {
+			size_t separator{root_spec.find('=')};
 
-							for (const string& file_path : get<0>(file_tree_file_diff_)) {
-								if (send_file(sock, file_path) > 0) {
-									console->warn("Could not send file "
-										"'{}'.", file_path);
-								}
-							}
+			if (root_error != 0) {
+				break;
+			} else if (separator == string::npos || separator == 0) {
+				console->error("Root '{}' is not of the form name=path.", 
+					root_spec);
+				root_error = EINVAL;
+			} else {
+				root_error = add_root(context, root_spec.substr(0, separator), 
+					root_spec.substr(separator + 1));
+			}
+		}
 
-							send_protocol_separator(sock);
+		if (root_error != 0) {
+			return root_error;
+		}
 
-							// Request files that are missing on the server
+		io_context ctx;
+		tcp::acceptor acceptor{ctx, tcp::endpoint{tcp::v4(), port}};
+		mutex accept_mtx;
 
-							for (const string& file_path : get<1>(file_tree_file_diff_)) {
-								if (send_file_request(sock, file_path) > 0) {
-									console->warn("Could not request file "
-										"'{}'.", file_path);									
-								}
-							}
+		// Workers take turns accepting, sessions of different roots run 
+		// concurrently
+		auto worker{[&]() {
+			while (true) {
+				error_code error_code_;
 
-							send_protocol_separator(sock);
+				unique_lock<mutex> accept_lock{accept_mtx};
+				tcp::socket sock{acceptor.accept(error_code_)};
+				accept_lock.unlock();
 
-							// Receive files
+				if (error_code_) {
+					console->error("Connection could not be established. ({})", 
+						error_code_.message());
+					continue;
+				}
 
-							if (recv_files(sock) > 0) {
-								console->warn("Could not receive all requested files.");
-							}
+				serve_session(sock, context);
+				TRACE_SESSION(0);
+			}
+		}};
 
-							sock.close();
-						}
-					} else {
-						console->error("Unexpected message type ({}:{}). "
-							"Closing connection.", ip_address, port);
+		vector<thread> workers;
 
-						sock.close();
-					}
-				}		
-			}
+		// The main thread is one of the workers
+		for (unsigned int i{1}; i < session_workers; i++) {
+			workers.emplace_back([&]() {
+				TRACE_THREAD_NAME("session");
 
-		} else {
-			console->error(repr_chdir_error(errno));
-			return errno;
+				worker();
+			});
 		}
+		worker();
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,321 @@
+#include "journal.h"
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "spdlog/spdlog.h"
+
+#include "shared.h"
+#include "trace.h"
+
+#include "dir_sync.pb.h"
+
+using std::string;
+using std::unordered_map;
+using std::unordered_set;
+
+using spdlog::stdout_color_mt;
+
+using dir_sync::FileMetadata;
+using dir_sync::DirectoryMetadata;
+
+auto journal_console{stdout_color_mt("journal")};
+
+const char PEER_ID_FILE[]{"peer_id"};
+const char JOURNAL_SUFFIX[]{".journal"};
+// Random bytes in a peer id
+const int PEER_ID_SIZE{16};
+
+// Written next to the destination, renamed over it once synced to disk
+bool write_durably(int root_fd, const string& path, const string& data) {
+	string temporary_path{path + ".tmp"};
+	int fd{openat(root_fd, temporary_path.c_str(), 
+		O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+
+	if (fd < 0) {
+		return false;
+	}
+
+	bool written{write(fd, data.data(), data.size()) == 
+		static_cast<ssize_t>(data.size()) && fsync(fd) == 0};
+	close(fd);
+
+	if (!written || renameat(root_fd, temporary_path.c_str(), root_fd, 
+		path.c_str()) != 0) {
+		unlinkat(root_fd, temporary_path.c_str(), 0);
+		return false;
+	}
+
+	return true;
+}
+
+bool read_file(int root_fd, const string& path, string& data) {
+	int fd{openat(root_fd, path.c_str(), O_RDONLY)};
+
+	if (fd < 0) {
+		return false;
+	}
+
+	char buffer[4096];
+	ssize_t read_size;
+
+	data.clear();
+
+	while ((read_size = read(fd, buffer, sizeof(buffer))) > 0) {
+		data.append(buffer, static_cast<size_t>(read_size));
+	}
+	close(fd);
+
+	return read_size == 0;
+}
+
+string local_peer_id(int root_fd) {
+	string path{string(JOURNAL_DIRECTORY) + "/" + PEER_ID_FILE};
+	string peer_id;
+
+	if (read_file(root_fd, path, peer_id) && valid_peer_id(peer_id)) {
+		return peer_id;
+	}
+
+	unsigned char random[PEER_ID_SIZE];
+	const char digits[]{"0123456789abcdef"};
+
+	if (RAND_bytes(random, PEER_ID_SIZE) != 1) {
+		return "";
+	}
+
+	peer_id.clear();
+
+	for (unsigned char byte : random) {
+		peer_id += digits[byte >> 4];
+		peer_id += digits[byte & 0xf];
+	}
+
+	mkdirat(root_fd, JOURNAL_DIRECTORY, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+	if (!write_durably(root_fd, path, peer_id)) {
+		journal_console->warn("Could not store peer id, sessions won't be "
+			"journaled.");
+		return "";
+	}
+
+	return peer_id;
+}
+
+bool valid_peer_id(const string& peer_id) {
+	return !peer_id.empty() && peer_id.size() <= 2 * PEER_ID_SIZE && 
+		peer_id.find_first_not_of("0123456789abcdef") == string::npos;
+}
+
+SyncJournal::SyncJournal(int root_fd) : root_fd_{root_fd} {}
+
+string SyncJournal::path(const string& peer_id) const {
+	return string(JOURNAL_DIRECTORY) + "/" + peer_id + JOURNAL_SUFFIX;
+}
+
+bool SyncJournal::load(const string& peer_id, JournalRecord& record) const {
+	string data;
+
+	if (!valid_peer_id(peer_id) || !read_file(root_fd_, path(peer_id), data)) {
+		return false;
+	}
+
+	if (!record.ParseFromString(data) || record.peer_id() != peer_id) {
+		journal_console->warn("Journal of peer '{}' is damaged.", peer_id);
+		return false;
+	}
+
+	return true;
+}
+
+bool SyncJournal::store(const JournalRecord& record) const {
+	if (!valid_peer_id(record.peer_id())) {
+		return false;
+	}
+
+	mkdirat(root_fd_, JOURNAL_DIRECTORY, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+	return write_durably(root_fd_, path(record.peer_id()), 
+		record.SerializeAsString());
+}
+
+// Entries are tagged, a file and a directory never hash the same
+string file_entry(const FileMetadata& file) {
+	return "f" + file.SerializeAsString();
+}
+
+string directory_entry(const DirectoryMetadata& directory) {
+	return "d" + directory.SerializeAsString();
+}
+
+// Adds an entry's hash to the digest (or takes it away), 64 bits at a time 
+// with wraparound so the order of updates doesn't matter
+void update_digest(string* digest, const string& entry, bool remove=false) {
+	if (digest == nullptr) {
+		return;
+	}
+
+	string entry_digest{sha512_digest(entry)};
+
+	for (size_t offset{0}; offset < entry_digest.size(); 
+		offset += U_INT_64_SIZE) {
+		u_int64_t lane;
+		u_int64_t entry_lane;
+
+		memcpy(&lane, &(*digest)[offset], U_INT_64_SIZE);
+		memcpy(&entry_lane, &entry_digest[offset], U_INT_64_SIZE);
+
+		lane = remove ? lane - entry_lane : lane + entry_lane;
+
+		memcpy(&(*digest)[offset], &lane, U_INT_64_SIZE);
+	}
+}
+
+FileTree tree_delta(const FileTree& base, const FileTree& tree, 
+	string* digest) {
+	TRACE_SPAN("tree_delta");
+
+	FileTree delta;
+
+	unordered_map<string, const FileMetadata*> base_files;
+	unordered_set<string> base_directories;
+	unordered_set<string> file_paths;
+	unordered_set<string> directory_paths;
+
+	for (const FileMetadata& file : base.files()) {
+		base_files[file.relative_path()] = &file;
+	}
+	for (const DirectoryMetadata& directory : base.directories()) {
+		base_directories.insert(directory.relative_path());
+	}
+
+	for (const FileMetadata& file : tree.files()) {
+		auto base_file = base_files.find(file.relative_path());
+
+		if (base_file == base_files.end() || 
+			base_file->second->mtime() != file.mtime() || 
+			base_file->second->size() != file.size() || 
+			base_file->second->hash() != file.hash()) {
+			*delta.add_files() = file;
+
+			if (base_file != base_files.end()) {
+				update_digest(digest, file_entry(*base_file->second), true);
+			}
+			update_digest(digest, file_entry(file));
+		}
+		file_paths.insert(file.relative_path());
+	}
+
+	for (const DirectoryMetadata& directory : tree.directories()) {
+		if (base_directories.count(directory.relative_path()) == 0) {
+			*delta.add_directories() = directory;
+			update_digest(digest, directory_entry(directory));
+		}
+		directory_paths.insert(directory.relative_path());
+	}
+
+	// A directory that became a file (or the other way around) is removed 
+	// as well
+	for (const FileMetadata& file : base.files()) {
+		if (file_paths.count(file.relative_path()) == 0) {
+			delta.add_removed_files(file.relative_path());
+			update_digest(digest, file_entry(file), true);
+		}
+	}
+	for (const DirectoryMetadata& directory : base.directories()) {
+		if (directory_paths.count(directory.relative_path()) == 0) {
+			delta.add_removed_directories(directory.relative_path());
+			update_digest(digest, directory_entry(directory), true);
+		}
+	}
+
+	return delta;
+}
+
+FileTree apply_tree_delta(const FileTree& base, const FileTree& delta, 
+	string* digest) {
+	TRACE_SPAN("apply_tree_delta");
+
+	FileTree tree;
+
+	unordered_map<string, const FileMetadata*> changed_files;
+	unordered_set<string> removed;
+
+	for (const FileMetadata& file : delta.files()) {
+		changed_files[file.relative_path()] = &file;
+	}
+	for (const string& path : delta.removed_files()) {
+		removed.insert(path);
+	}
+	for (const string& path : delta.removed_directories()) {
+		removed.insert(path);
+	}
+
+	for (const DirectoryMetadata& directory : base.directories()) {
+		if (removed.count(directory.relative_path()) == 0) {
+			*tree.add_directories() = directory;
+		} else {
+			update_digest(digest, directory_entry(directory), true);
+		}
+	}
+	for (const DirectoryMetadata& directory : delta.directories()) {
+		*tree.add_directories() = directory;
+		update_digest(digest, directory_entry(directory));
+	}
+
+	// Changed files replace their base entry, new ones are appended
+	for (const FileMetadata& file : base.files()) {
+		auto changed_file = changed_files.find(file.relative_path());
+
+		if (changed_file != changed_files.end()) {
+			*tree.add_files() = *changed_file->second;
+			update_digest(digest, file_entry(file), true);
+			update_digest(digest, file_entry(*changed_file->second));
+			changed_files.erase(changed_file);
+		} else if (removed.count(file.relative_path()) == 0) {
+			*tree.add_files() = file;
+		} else {
+			update_digest(digest, file_entry(file), true);
+		}
+	}
+	for (const FileMetadata& file : delta.files()) {
+		if (changed_files.count(file.relative_path()) > 0) {
+			*tree.add_files() = file;
+			update_digest(digest, file_entry(file));
+		}
+	}
+
+	return tree;
+}
+
+string tree_digest(const FileTree& tree) {
+	TRACE_SPAN("tree_digest");
+
+	string digest(SHA512_DIGEST_LENGTH, '\0');
+
+	for (const DirectoryMetadata& directory : tree.directories()) {
+		update_digest(&digest, directory_entry(directory));
+	}
+	for (const FileMetadata& file : tree.files()) {
+		update_digest(&digest, file_entry(file));
+	}
+
+	return digest;
+}
+
+string record_digest(const JournalRecord& record) {
+	if (record.digest().size() == SHA512_DIGEST_LENGTH) {
+		return record.digest();
+	}
+
+	return tree_digest(record.tree());
+}
@@ -0,0 +1,206 @@
+#include "local_sync.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "spdlog/spdlog.h"
+
+#include "shared.h"
+#include "tree_diff.h"
+#include "trace.h"
+
+#include "dir_sync.pb.h"
+
+using std::string;
+using std::vector;
+using std::thread;
+using std::atomic;
+using std::min;
+using std::sort;
+using std::get;
+using std::unordered_map;
+
+using spdlog::stdout_color_mt;
+
+using dir_sync::FileMetadata;
+
+auto local_console{stdout_color_mt("local")};
+
+struct local_copy {
+	string relative_path;
+	string source_path;
+	string destination_path;
+	time_t mtime;
+	unsigned long long size;
+};
+
+void create_directories(const string& root, const file_tree_dir_diff& paths,
+	bool dry_run, local_sync_result& result) {
+	// Parents are listed before their children
+	for (const string& relative_path : paths) {
+		local_console->debug("Creating directory '{}/{}'", root, relative_path);
+
+		if (dry_run) {
+			continue;
+		}
+
+		if (mkdir((root + "/" + relative_path).c_str(),
+			S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) < 0 && errno != EEXIST) {
+			local_console->warn("Could not create directory '{}/{}'.", root,
+				relative_path);
+			result.failed++;
+		} else {
+			result.directories++;
+		}
+	}
+}
+
+void plan_copies(const vector<string>& relative_paths, const string& source,
+	const FileTree& source_tree, const string& destination,
+	vector<local_copy>& copies) {
+	unordered_map<string, const FileMetadata*> source_files;
+
+	for (const FileMetadata& file : source_tree.files()) {
+		source_files[file.relative_path()] = &file;
+	}
+
+	for (const string& relative_path : relative_paths) {
+		const FileMetadata* file{source_files.at(relative_path)};
+
+		copies.push_back({relative_path, source + "/" + relative_path,
+			destination + "/" + relative_path, file->mtime(),
+			static_cast<unsigned long long>(file->size())});
+	}
+}
+
+bool sync_local(const string& first, const string& second,
+	const local_sync_options& options, local_sync_result& result) {
+	TRACE_SPAN("sync_local");
+
+	int first_fd{open(first.c_str(), O_RDONLY | O_DIRECTORY)};
+	int second_fd{open(second.c_str(), O_RDONLY | O_DIRECTORY)};
+
+	if (first_fd < 0 || second_fd < 0) {
+		close(first_fd);
+		close(second_fd);
+		return false;
+	}
+
+	// Both trees are scanned at once, they usually live on different disks
+	FileTree second_tree;
+	thread second_scan{[&]() {
+		TRACE_THREAD_NAME("scan");
+
+		second_tree = get_file_tree(second_fd, options.filter, options.strict);
+	}};
+	FileTree first_tree{get_file_tree(first_fd, options.filter, 
+		options.strict)};
+	second_scan.join();
+
+	// Only files that can't be told apart by their metadata are hashed
+	vector<string> ambiguous{ambiguous_files(first_tree, second_tree)};
+
+	hash_files(first_tree, ambiguous, first_fd);
+	hash_files(second_tree, ambiguous, second_fd);
+
+	// Identical copies take the first one's mtime, they aren't hashed again 
+	// next time
+	for (const FileMetadata* file : identical_files(first_tree, second_tree)) {
+		if (options.dry_run) {
+			local_console->info("Would set mtime of '{}/{}'", second, 
+				file->relative_path());
+		} else if (!set_mtime(file->mtime(), file->relative_path(), second_fd)) {
+			local_console->warn("Could not set mtime for '{}/{}'.", second, 
+				file->relative_path());
+		}
+	}
+
+	close(first_fd);
+	close(second_fd);
+
+	file_tree_file_diff file_diff{diff_file_tree_files(first_tree,
+		second_tree)};
+
+	create_directories(second, diff_file_tree_directories(first_tree,
+		second_tree), options.dry_run, result);
+	create_directories(first, diff_file_tree_directories(second_tree,
+		first_tree), options.dry_run, result);
+
+	vector<local_copy> copies;
+
+	plan_copies(get<0>(file_diff), first, first_tree, second, copies);
+	plan_copies(get<1>(file_diff), second, second_tree, first, copies);
+
+	if (options.dry_run) {
+		for (const local_copy& copy : copies) {
+			local_console->info("Would copy '{}' to '{}' ({} B)",
+				copy.source_path, copy.destination_path, copy.size);
+		}
+
+		return true;
+	}
+
+	// Largest files first, they don't end up as the last job of one worker
+	sort(copies.begin(), copies.end(),
+		[](const local_copy& a, const local_copy& b) {
+			return a.size > b.size;
+		});
+
+	atomic<size_t> next_copy{0};
+	atomic<unsigned long long> files{0};
+	atomic<unsigned long long> bytes{0};
+	atomic<unsigned long long> failed{0};
+
+	auto worker{[&]() {
+		for (size_t i{next_copy++}; i < copies.size(); i = next_copy++) {
+			const local_copy& copy{copies[i]};
+
+			TRACE_SPAN_DETAIL("copy_file", copy.relative_path);
+
+			local_console->debug("Copying '{}' to '{}'", copy.source_path,
+				copy.destination_path);
+
+			if (!copy_local_file(copy.source_path, copy.destination_path) ||
+				!set_mtime(copy.mtime, copy.destination_path)) {
+				local_console->warn("Could not copy '{}' to '{}'.",
+					copy.source_path, copy.destination_path);
+				failed++;
+			} else {
+				files++;
+				bytes += copy.size;
+			}
+		}
+	}};
+
+	vector<thread> workers;
+	size_t worker_count{min<size_t>(options.workers, copies.size())};
+
+	// The calling thread is one of the workers
+	for (size_t i{1}; i < worker_count; i++) {
+		workers.emplace_back([&]() {
+			TRACE_THREAD_NAME("copy");
+
+			worker();
+		});
+	}
+	worker();
+
+	for (thread& worker_ : workers) {
+		worker_.join();
+	}
+
+	result.files += files;
+	result.bytes += bytes;
+	result.failed += failed;
+
+	return true;
+}
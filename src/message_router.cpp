@@ -0,0 +1,17 @@
+#include "message_router.h"
+
+#include <string>
+
+using std::string;
+
+int MessageRouter::dispatch(MessageType type, const string& serialized_message,
+	string& raw) {
+	unsigned int type_index{index(type)};
+
+	if (type_index < MESSAGE_TYPE_COUNT && handlers_[type_index]) {
+		return handlers_[type_index](serialized_message, raw);
+	}
+
+	return type == MessageType::ProtocolSeparator ? PROTO_TYPE_STAGE_END :
+		PROTO_TYPE_WRONG;
+}
@@ -0,0 +1,238 @@
+#include "multiplexer.h"
+
+#include <string>
+#include <array>
+#include <mutex>
+#include <cstring>
+#include <utility>
+#include <condition_variable>
+
+#include "asio.hpp"
+
+#include <google/protobuf/message.h>
+
+#include "trace.h"
+
+using std::string;
+using std::array;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::move;
+
+using asio::buffer;
+using asio::const_buffer;
+using asio::write;
+using asio::error_code;
+
+using google::protobuf::Message;
+
+#define TRY(fn_with_ec) fn_with_ec; if (error_code_) { return ASIO_ERROR; }
+
+// Stream and size of trailing raw data, followed by a serialize_proto() 
+// frame (type, size, message) and the raw data
+const unsigned int MUX_HEADER_SIZE{U_INT_8_SIZE + U_INT_64_SIZE};
+const unsigned int FRAME_HEADER_SIZE{U_INT_8_SIZE + U_INT_64_SIZE};
+
+Multiplexer::Multiplexer(tcp::socket& sock) : sock_{sock}, read_sock_{sock} {}
+
+Multiplexer::Multiplexer(tcp::socket& sock, tcp::socket& read_sock) : 
+	sock_{sock}, read_sock_{read_sock} {}
+
+int Multiplexer::write_frame(Stream stream, const string& serialized_message, 
+	u_int64_t raw_size) {
+	error_code error_code_;
+
+	char header[MUX_HEADER_SIZE];
+	header[0] = static_cast<char>(stream);
+	memcpy(&header[U_INT_8_SIZE], &raw_size, U_INT_64_SIZE);
+
+	// One gather write, the frame isn't split into two segments
+	array<const_buffer, 2> buffers{{buffer(header), 
+		buffer(serialized_message)}};
+
+	TRY(write(sock_, buffers, error_code_));
+
+	return SEND_OK;
+}
+
+int Multiplexer::send_serialized(Stream stream, 
+	const string& serialized_message) {
+	// Includes waiting for other senders
+	TRACE_SPAN("mux_send");
+
+	lock_guard<mutex> guard{send_mtx_};
+
+	return write_frame(stream, serialized_message, 0);
+}
+
+int Multiplexer::send_serialized_zero_copy(Stream stream, 
+	const string& serialized_message, int fd, long long offset, 
+	size_t length) {
+	TRACE_SPAN("mux_send_zero_copy");
+
+	lock_guard<mutex> guard{send_mtx_};
+
+	if (write_frame(stream, serialized_message, length) != SEND_OK) {
+		return ASIO_ERROR;
+	}
+
+	return send_file_range(sock_, fd, offset, length);
+}
+
+int Multiplexer::read_frame(unsigned int& stream_index, mux_frame& frame) {
+	error_code error_code_;
+
+	char header[MUX_HEADER_SIZE + FRAME_HEADER_SIZE];
+	u_int64_t raw_size;
+	u_int64_t message_size;
+
+	TRY(read(read_sock_, buffer(header), error_code_));
+
+	stream_index = static_cast<u_int8_t>(header[0]);
+	memcpy(&raw_size, &header[U_INT_8_SIZE], U_INT_64_SIZE);
+	frame.type = static_cast<MessageType>(
+		static_cast<u_int8_t>(header[MUX_HEADER_SIZE]));
+	memcpy(&message_size, &header[MUX_HEADER_SIZE + U_INT_8_SIZE], 
+		U_INT_64_SIZE);
+
+	if (stream_index >= STREAM_COUNT || message_size > MAX_MESSAGE_SIZE || 
+		raw_size > MAX_RAW_SIZE) {
+		return PROTO_TYPE_WRONG;
+	}
+
+	frame.message.resize(message_size);
+	frame.raw.resize(raw_size);
+
+	if (message_size > 0) {
+		TRY(read(read_sock_, buffer(&frame.message[0], message_size), error_code_));
+	}
+	if (raw_size > 0) {
+		TRY(read(read_sock_, buffer(&frame.raw[0], raw_size), error_code_));
+	}
+
+	return PROTO_TYPE_OK;
+}
+
+bool Multiplexer::backlogged(Stream stream) const {
+	for (unsigned int i{0}; i < STREAM_COUNT; i++) {
+		if (i != static_cast<unsigned int>(stream) && 
+			queued_bytes_[i] >= MAX_QUEUED_BYTES) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int Multiplexer::next_frame(Stream stream, mux_frame& frame) {
+	unsigned int index{static_cast<unsigned int>(stream)};
+	deque<mux_frame>& queue{queues_[index]};
+
+	unique_lock<mutex> lock{recv_mtx_};
+
+	while (queue.empty()) {
+		if (closed_) {
+			return ASIO_ERROR;
+		}
+
+		// The next frame might go to a stream that is full as well
+		if (reading_ || backlogged(stream)) {
+			frame_queued_.wait(lock);
+			continue;
+		}
+
+		// This receiver reads until a frame of its own stream shows up
+		reading_ = true;
+		lock.unlock();
+
+		unsigned int stream_index;
+		mux_frame read;
+		int error_code_{read_frame(stream_index, read)};
+
+		lock.lock();
+		reading_ = false;
+
+		if (error_code_ > 0) {
+			// Broken or out of sync, every receiver gives up
+			closed_ = true;
+		} else {
+			queued_bytes_[stream_index] += read.message.size() + read.raw.size();
+			queues_[stream_index].push_back(move(read));
+		}
+		frame_queued_.notify_all();
+	}
+
+	frame = move(queue.front());
+	queue.pop_front();
+
+	bool was_full{queued_bytes_[index] >= MAX_QUEUED_BYTES};
+
+	queued_bytes_[index] -= frame.message.size() + frame.raw.size();
+
+	// Lets a reader waiting for this stream go on
+	if (was_full && queued_bytes_[index] < MAX_QUEUED_BYTES) {
+		frame_queued_.notify_all();
+	}
+
+	return PROTO_TYPE_OK;
+}
+
+int Multiplexer::recv(Stream stream, MessageType type, Message& message, 
+	string& raw) {
+	TRACE_SPAN_DETAIL("mux_recv", message.GetTypeName());
+
+	mux_frame frame;
+
+	if (next_frame(stream, frame) > 0) {
+		return ASIO_ERROR;
+	}
+
+	if (frame.type == type) {
+		message.ParseFromString(frame.message);
+		raw.swap(frame.raw);
+
+		return PROTO_TYPE_OK;
+	} else if (frame.type == MessageType::ProtocolSeparator) {
+		return PROTO_TYPE_STAGE_END;
+	}
+
+	return PROTO_TYPE_WRONG;
+}
+
+int Multiplexer::route(Stream stream, MessageRouter& router) {
+	int error_code_{ROUTE_NEXT};
+
+	while (error_code_ == ROUTE_NEXT) {
+		TRACE_SPAN("mux_route");
+
+		mux_frame frame;
+
+		if (next_frame(stream, frame) > 0) {
+			return ASIO_ERROR;
+		}
+
+		error_code_ = router.dispatch(frame.type, frame.message, frame.raw);
+	}
+
+	return error_code_;
+}
+
+void Multiplexer::shutdown() {
+	error_code error_code_;
+
+	{
+		lock_guard<mutex> guard{recv_mtx_};
+
+		closed_ = true;
+		frame_queued_.notify_all();
+	}
+
+	sock_.shutdown(tcp::socket::shutdown_both, error_code_);
+}
+
+int send_protocol_separator(Multiplexer& mux, Stream stream) {
+	ProtocolSeparator protocol_stage_complete;
+
+	return mux.send(stream, protocol_stage_complete);
+}
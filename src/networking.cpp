@@ -1,6 +1,18 @@
 #include "networking.h"
 
 #include <tuple>
+#include <string>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "asio.hpp"
 #include "spdlog/spdlog.h"
@@ -8,13 +20,23 @@
 
 #include <google/protobuf/message.h>
 
+#include "trace.h"
+#include "tcp_info.h"
+
 using std::ostream;
-using std::istream;
 
 using std::tuple;
 
+using std::string;
+
+using std::min;
+using std::max;
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+
 using asio::buffer;
-using asio::streambuf;
 using asio::ip::tcp;
 using asio::write;
 using asio::error_code;
@@ -35,54 +57,73 @@ constexpr auto to_underlying(E e) noexcept
 }
 
 
-int send_proto(tcp::socket& sock, Message& message) {
-	error_code error_code_;
-
-	u_int8_t message_type{to_underlying(proto_type_mapping.at(typeid(message)))};
+string serialize_proto(MessageType type, const Message& message) {
+	u_int8_t message_type{to_underlying(type)};
 
 	u_int64_t message_size{message.ByteSizeLong()};
 
-	TRY(write(sock, buffer(&message_type, U_INT_8_SIZE), error_code_));
-	TRY(write(sock, buffer(&message_size, U_INT_64_SIZE), error_code_));
-	
-	streambuf buf;
-	ostream os(&buf);
-	message.SerializeToOstream(&os);
+	string serialized_message(U_INT_8_SIZE + U_INT_64_SIZE + message_size, '\0');
 
-	TRY(write(sock, buf, error_code_));
+	memcpy(&serialized_message[0], &message_type, U_INT_8_SIZE);
+	memcpy(&serialized_message[U_INT_8_SIZE], &message_size, U_INT_64_SIZE);
 
-	return SEND_OK;
+	message.SerializeWithCachedSizesToArray(reinterpret_cast<u_int8_t*>(
+		&serialized_message[U_INT_8_SIZE + U_INT_64_SIZE]));
+
+	return serialized_message;
 }
 
-int recv_proto(tcp::socket& sock, Message& message) {
+int send_serialized(tcp::socket& sock, const string& serialized_message) {
 	error_code error_code_;
 
-	MessageType expected_message_type{proto_type_mapping.at(typeid(message))};
+	TRY(write(sock, buffer(serialized_message), error_code_));
 
-	u_int8_t message_type_raw;
-	MessageType message_type;
+	return SEND_OK;
+}
 
+int send_proto(tcp::socket& sock, MessageType type, const Message& message) {
+	TRACE_SPAN_DETAIL("send_proto", message.GetTypeName());
+
+	return send_serialized(sock, serialize_proto(type, message));
+}
+
+int recv_frame(tcp::socket& sock, MessageType& type, string& message) {
+	error_code error_code_;
+
+	u_int8_t message_type_raw;
 	u_int64_t message_size;
 
-	TRY(sock.receive(buffer(&message_type_raw, U_INT_8_SIZE), 0, error_code_));
+	// receive() may return less than requested once headers span segments
+	TRY(read(sock, buffer(&message_type_raw, U_INT_8_SIZE), error_code_));
+	TRY(read(sock, buffer(&message_size, U_INT_64_SIZE), error_code_));
 
-	message_type = static_cast<MessageType>(message_type_raw);
+	type = static_cast<MessageType>(message_type_raw);
 
-	TRY(sock.receive(buffer(&message_size, U_INT_64_SIZE), 0));
+	if (message_size > MAX_MESSAGE_SIZE) {
+		return PROTO_TYPE_WRONG;
+	}
 
-	streambuf buf;
-	streambuf::mutable_buffers_type mbt{buf.prepare(message_size)};
+	message.resize(message_size);
 
-	buf.commit(read(sock, mbt, error_code_));
+	if (message_size > 0) {
+		TRY(read(sock, buffer(&message[0], message_size), error_code_));
+	}
+
+	return PROTO_TYPE_OK;
+}
+
+int recv_proto(tcp::socket& sock, MessageType type, Message& message) {
+	TRACE_SPAN_DETAIL("recv_proto", message.GetTypeName());
+
+	MessageType message_type;
+	string serialized_message;
 
-	if (error_code_) {
+	if (recv_frame(sock, message_type, serialized_message) > 0) {
 		return ASIO_ERROR;
 	}
 
-	if (message_type == expected_message_type) {
-		
-		istream is(&buf);
-		message.ParseFromIstream(&is);
+	if (message_type == type) {
+		message.ParseFromString(serialized_message);
 
 		return PROTO_TYPE_OK;
 	} else if (message_type == MessageType::ProtocolSeparator) {
@@ -90,4 +131,218 @@ int recv_proto(tcp::socket& sock, Message& message) {
 	}
 
 	return PROTO_TYPE_WRONG;
-}
\ No newline at end of file
+}
+
+int send_file_range(tcp::socket& sock, int fd, long long offset, 
+	size_t length) {
+#ifdef __linux__
+	off_t file_offset{offset};
+
+	while (length > 0) {
+		ssize_t bytes_sent{sendfile(sock.native_handle(), fd, &file_offset, 
+			length)};
+
+		if (bytes_sent <= 0) {
+			if (bytes_sent < 0 && errno == EINTR) {
+				continue;
+			}
+			return ASIO_ERROR;
+		}
+		length -= bytes_sent;
+	}
+#else
+	error_code error_code_;
+	string data(length, '\0');
+
+	if (pread(fd, &data[0], length, offset) != static_cast<ssize_t>(length)) {
+		return ASIO_ERROR;
+	}
+
+	TRY(write(sock, buffer(data), error_code_));
+#endif
+
+	return SEND_OK;
+}
+
+// Seconds it takes for a probe to be answered
+int time_probe(tcp::socket& sock, tcp::socket& read_sock, LinkProbe& probe, 
+	double& seconds) {
+	int error_code_{};
+
+	LinkProbe answer;
+	steady_clock::time_point start{steady_clock::now()};
+
+	error_code_ = send_proto(sock, probe);
+
+	if (error_code_ > 0) {
+		return error_code_;
+	}
+	if (recv_proto(read_sock, answer) != PROTO_TYPE_OK) {
+		return PROTO_TYPE_WRONG;
+	}
+
+	seconds = duration<double>(steady_clock::now() - start).count();
+
+	return PROBE_OK;
+}
+
+int probe_link(tcp::socket& sock, tcp::socket& read_sock, int tcp_fd, 
+	link_estimate& link) {
+	int error_code_{};
+
+	LinkProbe probe;
+	LinkProbe answer;
+	double rtt;
+
+	error_code_ = time_probe(sock, read_sock, probe, rtt);
+
+	if (error_code_ > 0) {
+		return error_code_;
+	}
+
+	tcp_link_info info;
+
+	// Smoothed by the kernel, and not inflated by the queue the probes 
+	// below build up
+	if (read_tcp_info(tcp_fd, info) && info.rtt > 0) {
+		rtt = info.rtt;
+	}
+
+	// Long enough to get past the first rounds of slow start, short enough 
+	// not to hold up the session on slow links
+	double probe_time{min(max(LINK_PROBE_RTTS * rtt, MIN_LINK_PROBE_TIME), 
+		MAX_LINK_PROBE_TIME)};
+
+	probe.set_payload(string(LINK_PROBE_SIZE, '\0'));
+
+	string serialized_probe{serialize_proto(probe)};
+	unsigned long long probes_sent{0};
+	unsigned long long answers{0};
+	error_code available_error;
+
+	steady_clock::time_point start{steady_clock::now()};
+	steady_clock::time_point deadline{start + 
+		duration_cast<steady_clock::duration>(duration<double>(probe_time))};
+
+	while (steady_clock::now() < deadline) {
+		error_code_ = send_serialized(sock, serialized_probe);
+
+		if (error_code_ > 0) {
+			return error_code_;
+		}
+		probes_sent++;
+
+		// Answers are collected on the way, the peer never blocks on them
+		while (answers < probes_sent && 
+			read_sock.available(available_error) > 0) {
+			if (recv_proto(read_sock, answer) != PROTO_TYPE_OK) {
+				return PROTO_TYPE_WRONG;
+			}
+			answers++;
+		}
+	}
+
+	for (; answers < probes_sent; answers++) {
+		if (recv_proto(read_sock, answer) != PROTO_TYPE_OK) {
+			return PROTO_TYPE_WRONG;
+		}
+	}
+
+	double elapsed{duration<double>(steady_clock::now() - start).count()};
+
+	link.rtt = rtt;
+	// Lower bound: slow start is part of the measurement
+	link.throughput = probes_sent * LINK_PROBE_SIZE / max(elapsed - rtt, 1e-6);
+
+	// Rate of the last round trips, past most of slow start
+	if (read_tcp_info(tcp_fd, info)) {
+		link.throughput = max(link.throughput, info.delivery_rate);
+	}
+
+	LinkProbe result;
+	result.set_rtt(static_cast<long long>(link.rtt * 1e6));
+	result.set_throughput(static_cast<long long>(link.throughput));
+
+	return send_proto(sock, result);
+}
+
+int probe_link(tcp::socket& sock, link_estimate& link) {
+	return probe_link(sock, sock, sock.native_handle(), link);
+}
+
+int answer_link_probes(tcp::socket& sock, tcp::socket& read_sock, 
+	link_estimate& link) {
+	int error_code_{};
+
+	LinkProbe probe;
+	LinkProbe answer;
+
+	while (true) {
+		if (recv_proto(read_sock, probe) != PROTO_TYPE_OK) {
+			return PROTO_TYPE_WRONG;
+		}
+
+		if (probe.has_throughput()) {
+			link.rtt = probe.rtt() / 1e6;
+			link.throughput = probe.throughput();
+
+			return PROBE_OK;
+		}
+
+		error_code_ = send_proto(sock, answer);
+
+		if (error_code_ > 0) {
+			return error_code_;
+		}
+	}
+}
+
+int answer_link_probes(tcp::socket& sock, link_estimate& link) {
+	return answer_link_probes(sock, sock, link);
+}
+
+// Current size of a socket buffer, Linux reports twice the size that was set
+int get_buffer_size(int fd, int option) {
+	int value{0};
+	socklen_t value_size{sizeof(value)};
+
+	getsockopt(fd, SOL_SOCKET, option, &value, &value_size);
+
+#ifdef __linux__
+	value /= 2;
+#endif
+
+	return value;
+}
+
+void tune_socket(int fd, const link_estimate& link) {
+	int no_delay{1};
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+	int buffer_size{static_cast<int>(min<double>(
+		2 * link.rtt * link.throughput, MAX_SOCKET_BUFFER))};
+
+	// Setting a size disables the kernel's auto tuning, buffers are only 
+	// ever grown
+	for (int option : {SO_SNDBUF, SO_RCVBUF}) {
+		if (buffer_size > get_buffer_size(fd, option)) {
+			setsockopt(fd, SOL_SOCKET, option, &buffer_size, 
+				sizeof(buffer_size));
+		}
+	}
+
+	networking_console->debug("RTT {:.3f} ms, {:.1f} MB/s, socket buffers {} B", 
+		link.rtt * 1e3, link.throughput / 1e6, buffer_size);
+}
+
+void set_cork(int fd, bool cork) {
+#ifdef TCP_CORK
+	int value{cork ? 1 : 0};
+
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#else
+	(void) fd;
+	(void) cork;
+#endif
+}
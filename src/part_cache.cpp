@@ -0,0 +1,84 @@
+#include "part_cache.h"
+
+#include <string>
+#include <memory>
+#include <mutex>
+
+using std::string;
+using std::to_string;
+using std::shared_ptr;
+using std::mutex;
+using std::lock_guard;
+
+string part_key(const string& relative_path, const string& hash, 
+	unsigned long long offset, unsigned long long length) {
+	// '\0' can't be part of a path or a hex digest
+	string key{relative_path};
+	key += '\0';
+	key += hash;
+	key += '\0';
+	key += to_string(offset);
+	key += '\0';
+	key += to_string(length);
+
+	return key;
+}
+
+PartCache::PartCache(unsigned long long capacity) : capacity_{capacity} {}
+
+shared_ptr<const string> PartCache::get(const string& relative_path, 
+	const string& hash, unsigned long long offset, unsigned long long length) {
+	lock_guard<mutex> guard{mtx_};
+
+	auto it = entries_.find(part_key(relative_path, hash, offset, length));
+
+	if (it == entries_.end()) {
+		return nullptr;
+	}
+
+	lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+
+	return it->second.serialized_part;
+}
+
+void PartCache::put(const string& relative_path, const string& hash, 
+	unsigned long long offset, unsigned long long length, 
+	shared_ptr<const string> serialized_part) {
+	if (serialized_part->size() > capacity_) {
+		return;
+	}
+
+	string key{part_key(relative_path, hash, offset, length)};
+
+	lock_guard<mutex> guard{mtx_};
+
+	auto it = entries_.find(key);
+
+	if (it != entries_.end()) {
+		// Another session was faster
+		lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+		return;
+	}
+
+	lru_.push_front(key);
+	entries_[key] = {serialized_part, lru_.begin()};
+	size_ += serialized_part->size();
+
+	evict();
+}
+
+unsigned long long PartCache::size() {
+	lock_guard<mutex> guard{mtx_};
+
+	return size_;
+}
+
+void PartCache::evict() {
+	while (size_ > capacity_ && !lru_.empty()) {
+		auto it = entries_.find(lru_.back());
+
+		size_ -= it->second.serialized_part->size();
+		entries_.erase(it);
+		lru_.pop_back();
+	}
+}
@@ -0,0 +1,250 @@
+#include "path_filter.h"
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <unordered_map>
+
+using std::string;
+using std::vector;
+using std::unordered_map;
+
+// Matches a bracket expression at the start of pattern against c. 
+// Returns a pointer past the closing ']' or nullptr if the expression is 
+// unterminated, matched is set accordingly.
+const char* match_class(const char* pattern, char c, bool& matched) {
+	const char* p{pattern + 1};
+	bool invert{*p == '!' || *p == '^'};
+
+	if (invert) {
+		p++;
+	}
+
+	matched = false;
+	bool first{true};
+
+	while (*p && (first || *p != ']')) {
+		char low{*p};
+
+		if (low == '\\' && p[1]) {
+			low = *++p;
+		}
+
+		char high{low};
+
+		if (p[1] == '-' && p[2] && p[2] != ']') {
+			high = p[2];
+			p += 2;
+		}
+
+		if (low <= c && c <= high) {
+			matched = true;
+		}
+
+		p++;
+		first = false;
+	}
+
+	if (*p != ']') {
+		return nullptr;
+	}
+
+	matched = matched != invert;
+
+	return p + 1;
+}
+
+bool glob_match(const char* pattern, const char* text) {
+	const char* p{pattern};
+	const char* t{text};
+
+	while (*p) {
+		if (p[0] == '*' && p[1] == '*') {
+			p += 2;
+
+			if (*p == '/') {
+				// "**/" matches zero or more directories
+				p++;
+				for (const char* s{t}; s != nullptr; s = strchr(s, '/')) {
+					if (*s == '/') {
+						s++;
+					}
+					if (glob_match(p, s)) {
+						return true;
+					}
+				}
+				return false;
+			}
+
+			for (const char* s{t}; ; s++) {
+				if (glob_match(p, s)) {
+					return true;
+				}
+				if (*s == '\0') {
+					return false;
+				}
+			}
+		}
+
+		if (*p == '*') {
+			p++;
+
+			for (const char* s{t}; ; s++) {
+				if (glob_match(p, s)) {
+					return true;
+				}
+				if (*s == '\0' || *s == '/') {
+					return false;
+				}
+			}
+		}
+
+		if (*t == '\0') {
+			return false;
+		}
+
+		if (*p == '?') {
+			if (*t == '/') {
+				return false;
+			}
+		} else if (*p == '[') {
+			bool matched;
+			const char* class_end{match_class(p, *t, matched)};
+
+			if (class_end != nullptr) {
+				if (!matched || *t == '/') {
+					return false;
+				}
+				p = class_end;
+				t++;
+				continue;
+			} else if (*t != '[') {
+				return false;
+			}
+		} else {
+			if (*p == '\\' && p[1]) {
+				p++;
+			}
+			if (*p != *t) {
+				return false;
+			}
+		}
+
+		p++;
+		t++;
+	}
+
+	return *t == '\0';
+}
+
+void PathFilter::add_rule(string rule_) {
+	rule compiled{rule_, false, false, false};
+
+	if (!compiled.pattern.empty() && compiled.pattern[0] == '!') {
+		compiled.negated = true;
+		compiled.pattern.erase(0, 1);
+	}
+
+	if (!compiled.pattern.empty() && compiled.pattern.back() == '/') {
+		compiled.directory_only = true;
+		compiled.pattern.pop_back();
+	}
+
+	if (compiled.pattern.find('/') != string::npos) {
+		compiled.anchored = true;
+
+		if (compiled.pattern[0] == '/') {
+			compiled.pattern.erase(0, 1);
+		}
+	}
+
+	if (compiled.pattern.empty()) {
+		return;
+	}
+
+	size_t index{rules_.size()};
+	rules_.push_back(compiled);
+
+	if (compiled.pattern.find_first_of("*?[\\") == string::npos) {
+		if (compiled.anchored) {
+			path_literals_[compiled.pattern].push_back(index);
+		} else {
+			name_literals_[compiled.pattern].push_back(index);
+		}
+	} else {
+		globs_.push_back(index);
+	}
+}
+
+bool PathFilter::empty() const {
+	return rules_.empty();
+}
+
+long long PathFilter::match_literals(
+	const unordered_map<string, vector<size_t>>& literals, const string& key, 
+	bool is_directory) const {
+	auto it = literals.find(key);
+
+	if (it != literals.end()) {
+		for (auto index = it->second.rbegin(); index != it->second.rend(); 
+			index++) {
+			if (is_directory || !rules_[*index].directory_only) {
+				return static_cast<long long>(*index);
+			}
+		}
+	}
+
+	return -1;
+}
+
+bool PathFilter::excluded(const string& relative_path, 
+	bool is_directory) const {
+	if (rules_.empty()) {
+		return false;
+	}
+
+	size_t name_start{relative_path.rfind('/')};
+	string name{name_start == string::npos ? 
+		relative_path : relative_path.substr(name_start + 1)};
+
+	long long match{match_literals(name_literals_, name, is_directory)};
+	long long path_match{match_literals(path_literals_, relative_path, 
+		is_directory)};
+
+	if (path_match > match) {
+		match = path_match;
+	}
+
+	for (auto index = globs_.rbegin(); index != globs_.rend() && 
+		static_cast<long long>(*index) > match; index++) {
+		const rule& rule_{rules_[*index]};
+
+		if (rule_.directory_only && !is_directory) {
+			continue;
+		}
+
+		if (glob_match(rule_.pattern.c_str(), rule_.anchored ? 
+			relative_path.c_str() : name.c_str())) {
+			match = static_cast<long long>(*index);
+			break;
+		}
+	}
+
+	return match >= 0 && !rules_[match].negated;
+}
+
+bool PathFilter::excluded_recursive(const string& relative_path, 
+	bool is_directory) const {
+	if (rules_.empty()) {
+		return false;
+	}
+
+	for (size_t separator{relative_path.find('/')}; separator != string::npos; 
+		separator = relative_path.find('/', separator + 1)) {
+		if (excluded(relative_path.substr(0, separator), true)) {
+			return true;
+		}
+	}
+
+	return excluded(relative_path, is_directory);
+}
@@ -2,25 +2,39 @@
 
 #include <string>
 #include <iostream>
-#include <mutex>
 #include <ctime>
 #include <vector>
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <memory>
+#include <unordered_set>
+#include <chrono>
 
 #include <unistd.h>
 #include <sys/stat.h> 
 #include <sys/mman.h>
 #include <fcntl.h>
-#include <ftw.h>
-#include <utime.h>
+#include <errno.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <zlib.h>
 
 #include "asio.hpp"
 #include "spdlog/spdlog.h"
 #include "fmt/format.h"
 
 #include "networking.h"
+#include "journal.h"
+#include "trace.h"
+#include "write_pool.h"
+#include "tcp_info.h"
 
 #include "dir_sync.pb.h"
 
@@ -32,11 +46,21 @@ using std::size_t;
 
 using std::time;
 
-using std::mutex;
-using std::lock_guard;
-
 using std::vector;
 
+using std::sort;
+using std::min;
+using std::max;
+
+using std::shared_ptr;
+using std::make_shared;
+
+using std::unordered_set;
+
+using std::chrono::steady_clock;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+
 using std::fstream;
 using std::ifstream;
 using std::ofstream;
@@ -55,89 +79,460 @@ using dir_sync::FileTree;
 using dir_sync::SanityCheck;
 using dir_sync::FileResponse;
 using dir_sync::MinimalFileMetadata;
+using dir_sync::FileHole;
+using dir_sync::ChunkRequest;
 
 #define TRY(fn) error_code_ = fn; if (error_code_ > 0) { return error_code_; }
 
-// Due to the API of nftw() it is necessary to define the actual
-// file collection at the global scope.
-mutex mtx;
-FileTree file_tree;
-
 auto shared_console{stdout_color_mt("shared")};
 
-string sha512_hash_file(int fd, long long size) {
-	unsigned char hash_result[SHA512_DIGEST_LENGTH];
+vector<file_extent> data_extents(int fd, long long size) {
+	vector<file_extent> extents;
+
+#ifdef SEEK_DATA
+	long long offset{0};
+
+	while (offset < size) {
+		off_t data_start{lseek(fd, offset, SEEK_DATA)};
+
+		if (data_start < 0) {
+			if (errno == ENXIO) {
+				// Only a hole remains
+				return extents;
+			}
+			// Holes are not supported by the file system
+			return {{0, size}};
+		}
+
+		off_t data_end{lseek(fd, data_start, SEEK_HOLE)};
+
+		if (data_end < 0) {
+			return {{0, size}};
+		}
+		if (data_end > size) {
+			data_end = size;
+		}
+
+		extents.push_back({data_start, data_end - data_start});
+		offset = data_end;
+	}
+#else
+	if (size > 0) {
+		extents.push_back({0, size});
+	}
+#endif
 
-	void* file_buffer{mmap(0, size, PROT_READ, 
-		MAP_SHARED, fd, 0)};
+	return extents;
+}
 
-	SHA512((unsigned char*) file_buffer, size, hash_result);
-	munmap(file_buffer, size); 
+void digest_zeros(EVP_MD_CTX* ctx, long long length) {
+	// Stands in for holes
+	static const string zeros(PART_SIZE, '\0');
+
+	for (long long offset{0}; offset < length; offset += PART_SIZE) {
+		EVP_DigestUpdate(ctx, zeros.data(), 
+			min<long long>(PART_SIZE, length - offset));
+	}
+}
+
+string hex_digest(EVP_MD_CTX* ctx) {
+	unsigned char hash_result[SHA512_DIGEST_LENGTH];
+
+	EVP_DigestFinal_ex(ctx, hash_result, nullptr);
 
 	string result{};
-	char buffer [2];
+	char buffer [3];
 
 	for (int i = 0; i < SHA512_DIGEST_LENGTH; i++) {
-		sprintf(buffer, "%02x", hash_result[i]);
+		snprintf(buffer, sizeof(buffer), "%02x", hash_result[i]);
 		result += buffer;
 	}
 
 	return result;
 }
 
-int process_file(const char* path, const struct stat* stats, int flag, struct FTW *) {
-	if (flag == FTW_D || flag == FTW_F) {
-		string relative_path{string(path)};
+string sha512_hash_file(int fd, long long size) {
+	EVP_MD_CTX* ctx{EVP_MD_CTX_new()};
+	EVP_DigestInit_ex(ctx, EVP_sha512(), nullptr);
+
+	void* file_buffer{size > 0 ? mmap(0, size, PROT_READ, 
+		MAP_SHARED, fd, 0) : MAP_FAILED};
+
+	if (file_buffer != MAP_FAILED) {
+		long long offset{0};
+
+		for (const file_extent& extent : data_extents(fd, size)) {
+			digest_zeros(ctx, extent.offset - offset);
+
+			EVP_DigestUpdate(ctx, static_cast<unsigned char*>(file_buffer) + 
+				extent.offset, extent.length);
+			offset = extent.offset + extent.length;
+		}
+		digest_zeros(ctx, size - offset);
+
+		munmap(file_buffer, size); 
+	}
+
+	string result{hex_digest(ctx)};
+	EVP_MD_CTX_free(ctx);
+
+	return result;
+}
+
+string sha512_digest(const char* data, size_t size) {
+	string digest(SHA512_DIGEST_LENGTH, '\0');
+
+	SHA512(reinterpret_cast<const unsigned char*>(data), size, 
+		reinterpret_cast<unsigned char*>(&digest[0]));
+
+	return digest;
+}
+
+string sha512_digest(const string& data) {
+	return sha512_digest(data.data(), data.size());
+}
+
+// Directory entry as returned by readdir(). The inode number is kept so
+// entries can be processed in (approximate) on-disk order.
+struct directory_entry {
+	string name;
+	ino_t inode;
+	unsigned char type;
+};
+
+struct entry_stat {
+	unsigned char type;
+	long long size;
+	time_t mtime;
+};
+
+unsigned char mode_to_type(mode_t mode) {
+	if (S_ISDIR(mode)) {
+		return DT_DIR;
+	} else if (S_ISREG(mode)) {
+		return DT_REG;
+	}
+	return DT_UNKNOWN;
+}
 
-		// Exclude paths like '.', './'
-		if (relative_path.length() > 2) {
-			relative_path = relative_path.substr(2, relative_path.length());
+#ifdef STATX_BASIC_STATS
+// Only the fields that are actually used are requested
+bool statx_entry(int dir_fd, const char* name, int flags, entry_stat& result) {
+	struct statx stat_;
 
-			switch (flag) {
-				// Directory
-				case FTW_D: 
-				{
-					DirectoryMetadata* directory_metadata = file_tree.add_directories();
+	if (statx(dir_fd, name, flags, STATX_TYPE | STATX_SIZE | STATX_MTIME, 
+		&stat_) < 0) {
+		return false;
+	}
 
-					directory_metadata->set_relative_path(relative_path);
+	result.type = mode_to_type(stat_.stx_mode);
+	result.size = stat_.stx_size;
+	result.mtime = stat_.stx_mtime.tv_sec;
 
+	return true;
+}
+#else
+void fill_entry_stat(const struct stat& stat_, entry_stat& result) {
+	result.type = mode_to_type(stat_.st_mode);
+	result.size = stat_.st_size;
+	result.mtime = stat_.st_mtime;
+}
+#endif
+
+// Follows symlinks
+bool stat_entry(int dir_fd, const char* name, entry_stat& result) {
+#ifdef STATX_BASIC_STATS
+	return statx_entry(dir_fd, name, 0, result);
+#else
+	struct stat stat_;
+
+	if (fstatat(dir_fd, name, &stat_, 0) < 0) {
+		return false;
+	}
+	fill_entry_stat(stat_, result);
+
+	return true;
+#endif
+}
+
+bool stat_fd(int fd, entry_stat& result) {
+#ifdef STATX_BASIC_STATS
+	return statx_entry(fd, "", AT_EMPTY_PATH, result);
+#else
+	struct stat stat_;
+
+	if (fstat(fd, &stat_) < 0) {
+		return false;
+	}
+	fill_entry_stat(stat_, result);
+
+	return true;
+#endif
+}
+
+void process_file(int dir_fd, const string& name, const string& relative_path, 
+	FileTree& file_tree, bool strict) {
+	// Quick check, the file isn't opened and its hash is left empty
+	if (!strict) {
+		entry_stat stats;
+
+		if (!stat_entry(dir_fd, name.c_str(), stats)) {
+			shared_console->warn("Could not stat '{0}'. Skipping...", 
+				relative_path);
+			return;
+		}
+
+		FileMetadata* file_metadata = file_tree.add_files();
+
+		file_metadata->set_relative_path(relative_path);
+		file_metadata->set_size(stats.size);
+		file_metadata->set_mtime(stats.mtime);
+		file_metadata->set_hash("");
+
+		return;
+	}
+
+	int fd{openat(dir_fd, name.c_str(), O_RDONLY)};
+	entry_stat stats;
+
+	if (fd < 0 || !stat_fd(fd, stats)) {
+		shared_console->warn("Could not open '{0}'. Skipping...", relative_path);
+	} else {
+		TRACE_SPAN_DETAIL("hash_file", relative_path);
+
+		FileMetadata* file_metadata = file_tree.add_files();
+
+		file_metadata->set_relative_path(relative_path);
+		file_metadata->set_size(stats.size);
+		file_metadata->set_mtime(stats.mtime);
+		file_metadata->set_hash(sha512_hash_file(fd, stats.size));
+	}
+	close(fd);
+}
+
+bool has_suffix(const char* name, const char* suffix) {
+	size_t name_length{strlen(name)};
+	size_t suffix_length{strlen(suffix)};
+	return name_length >= suffix_length && 
+		strcmp(name + name_length - suffix_length, suffix) == 0;
+}
+
+// depth counts the descriptors of dir_fd and its ancestors, directories 
+// that would exceed MAX_FDS are deferred to walk_tree()
+void walk_directory(int dir_fd, const string& relative_directory, 
+	unsigned short depth, vector<string>& deferred, FileTree& file_tree, 
+	const PathFilter& filter, bool strict) {
+	// fdopendir() takes ownership of the descriptor it is handed. A dup()
+	// would share its offset with dir_fd, long-lived root descriptors would
+	// read as empty on every scan after the first.
+	int stream_fd{openat(dir_fd, ".", O_RDONLY | O_DIRECTORY)};
+	DIR* dir_stream{stream_fd < 0 ? nullptr : fdopendir(stream_fd)};
+
+	if (dir_stream == nullptr) {
+		shared_console->warn("Could not read directory '{0}'. Skipping...", 
+			relative_directory);
+		close(stream_fd);
+		return;
+	}
+
+	vector<directory_entry> entries;
+	struct dirent* entry;
+
+	while ((entry = readdir(dir_stream)) != nullptr) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		// Journals are local to each peer
+		if (relative_directory.empty() && 
+			strcmp(entry->d_name, JOURNAL_DIRECTORY) == 0) {
+			continue;
+		}
+		// Left behind by an interrupted copy
+		if (has_suffix(entry->d_name, TEMPORARY_SUFFIX)) {
+			continue;
+		}
+		entries.push_back({entry->d_name, entry->d_ino, entry->d_type});
+	}
+	closedir(dir_stream);
+
+	// Visiting entries in inode order cuts down on seeks for inode 
+	// lookups and file contents
+	sort(entries.begin(), entries.end(), 
+		[](const directory_entry& a, const directory_entry& b) {
+			return a.inode < b.inode;
+		});
+
+	for (const directory_entry& entry_ : entries) {
+		string relative_path{relative_directory + entry_.name};
+		unsigned char type{entry_.type};
+
+		// d_type makes a stat() call unnecessary unless the file system 
+		// doesn't provide it or the entry is a symlink
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			entry_stat stats;
+
+			if (!stat_entry(dir_fd, entry_.name.c_str(), stats)) {
+				shared_console->warn("Could not stat '{0}'. Skipping...", 
+					relative_path);
+				continue;
+			}
+			if (type == DT_LNK && stats.type == DT_DIR) {
+				shared_console->debug("Not following symlinked directory '{0}'", 
+					relative_path);
+				continue;
+			}
+			type = stats.type;
+		}
+
+		switch (type) {
+			// Directory
+			case DT_DIR:
+			{
+				if (filter.excluded(relative_path, true)) {
+					shared_console->debug("Excluding directory '{0}'", relative_path);
 					break;
 				}
-				// File
-				case FTW_F:
-				{
-					int fd{open(path, O_RDONLY)};
-					if (fd < 0) {
-						shared_console->warn("Could not open '{0}'. Skipping...", path);
-					} else {
-						FileMetadata* file_metadata = file_tree.add_files();
-
-						file_metadata->set_relative_path(relative_path);
-						file_metadata->set_size(stats->st_size);
-						file_metadata->set_mtime(stats->st_mtime);
-						file_metadata->set_hash(sha512_hash_file(fd, stats->st_size));			
-					}
-					close(fd);
 
+				DirectoryMetadata* directory_metadata = file_tree.add_directories();
+
+				directory_metadata->set_relative_path(relative_path);
+
+				if (depth >= MAX_FDS) {
+					deferred.push_back(relative_path + "/");
 					break;
 				}
-			}			
-		}	
 
+				int child_fd{openat(dir_fd, entry_.name.c_str(), 
+					O_RDONLY | O_DIRECTORY)};
+
+				if (child_fd < 0) {
+					shared_console->warn("Could not open '{0}'. Skipping...", 
+						relative_path);
+				} else {
+					walk_directory(child_fd, relative_path + "/", depth + 1, deferred, 
+						file_tree, filter, strict);
+					close(child_fd);
+				}
+
+				break;
+			}
+			// File
+			case DT_REG:
+			{
+				if (filter.excluded(relative_path, false)) {
+					break;
+				}
+
+				process_file(dir_fd, entry_.name, relative_path, file_tree, strict);
+
+				break;
+			}
+		}
+	}
+}
+
+void walk_tree(int root_fd, FileTree& file_tree, const PathFilter& filter, 
+	bool strict) {
+	vector<string> deferred;
+
+	walk_directory(root_fd, "", 1, deferred, file_tree, filter, strict);
+
+	// Deep directories are opened by path from the root, the descriptors of 
+	// their ancestors are closed by now
+	while (!deferred.empty()) {
+		string relative_directory{deferred.back()};
+		deferred.pop_back();
+
+		int dir_fd{openat(root_fd, relative_directory.c_str(), 
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW)};
+
+		if (dir_fd < 0) {
+			shared_console->warn("Could not open '{0}'. Skipping...", 
+				relative_directory);
+			continue;
+		}
+
+		walk_directory(dir_fd, relative_directory, 2, deferred, file_tree, 
+			filter, strict);
+		close(dir_fd);
 	}
-	return 0;
 }
 
+FileTree get_file_tree(string path, const PathFilter& filter, bool strict) {
+	TRACE_SPAN_DETAIL("get_file_tree", path);
 
-FileTree get_file_tree(string path) {
-	lock_guard<mutex> guard{mtx};
-	file_tree.Clear();
+	FileTree file_tree;
 
-	nftw(path.c_str(), process_file, MAX_FDS, 0);
+	int root_fd{open(path.c_str(), O_RDONLY | O_DIRECTORY)};
+
+	if (root_fd < 0) {
+		shared_console->error("Could not open '{0}'.", path);
+	} else {
+		walk_tree(root_fd, file_tree, filter, strict);
+		close(root_fd);
+	}
+
+	return file_tree;
+}
+
+FileTree get_file_tree(int root_fd, const PathFilter& filter, bool strict) {
+	TRACE_SPAN("get_file_tree");
+
+	FileTree file_tree;
+
+	walk_tree(root_fd, file_tree, filter, strict);
 
 	return file_tree;
 }
 
+string hash_file(const string& relative_path, int root_fd) {
+	TRACE_SPAN_DETAIL("hash_file", relative_path);
+
+	int fd{openat(root_fd, relative_path.c_str(), O_RDONLY)};
+	entry_stat stats;
+	string hash;
+
+	if (fd >= 0 && stat_fd(fd, stats)) {
+		hash = sha512_hash_file(fd, stats.size);
+	}
+	close(fd);
+
+	return hash;
+}
+
+void hash_files(FileTree& file_tree, const vector<string>& relative_paths, 
+	int root_fd) {
+	unordered_set<string> paths(relative_paths.begin(), relative_paths.end());
+
+	for (FileMetadata& file : *file_tree.mutable_files()) {
+		if (file.hash().empty() && paths.count(file.relative_path()) > 0) {
+			file.set_hash(hash_file(file.relative_path(), root_fd));
+		}
+	}
+}
+
+void filter_file_tree(FileTree& file_tree, const PathFilter& filter) {
+	if (filter.empty()) {
+		return;
+	}
+
+	FileTree filtered_tree;
+
+	for (const DirectoryMetadata& directory : file_tree.directories()) {
+		if (!filter.excluded_recursive(directory.relative_path(), true)) {
+			*filtered_tree.add_directories() = directory;
+		}
+	}
+
+	for (const FileMetadata& file : file_tree.files()) {
+		if (!filter.excluded_recursive(file.relative_path(), false)) {
+			*filtered_tree.add_files() = file;
+		}
+	}
+
+	file_tree.Swap(&filtered_tree);
+}
+
 SanityCheck run_sanity_check() {
 	SanityCheck sanity_check;
 
@@ -175,18 +570,15 @@ void print_string_vector(vector<string> vec, bool verbose) {
 	}
 }
 
-bool set_mtime(time_t mtime, string path) {
-	struct stat old_stat;
-	struct utimbuf new_times;
+bool set_mtime(time_t mtime, string path, int root_fd) {
+	struct timespec new_times[2];
 
-	if (stat(path.c_str(), &old_stat) < 0) {
-		return false;
-	}
-
-	new_times.actime = old_stat.st_atime; /* keep atime unchanged */
-	new_times.modtime = mtime;    /* set mtime to current time */
+	new_times[0].tv_sec = 0;
+	new_times[0].tv_nsec = UTIME_OMIT; /* keep atime unchanged */
+	new_times[1].tv_sec = mtime;
+	new_times[1].tv_nsec = 0;
 	
-	if (utime(path.c_str(), &new_times) < 0) {
+	if (utimensat(root_fd, path.c_str(), new_times, 0) < 0) {
 		return false;
 	}
 
@@ -196,125 +588,983 @@ bool set_mtime(time_t mtime, string path) {
 	return true;
 }
 
-int send_file(tcp::socket& sock, string relative_path) {
+bool compress_part(const string& raw, string& compressed) {
+	uLongf compressed_size{compressBound(raw.size())};
+	compressed.resize(compressed_size);
+
+	if (compress2(reinterpret_cast<Bytef*>(&compressed[0]), &compressed_size, 
+		reinterpret_cast<const Bytef*>(raw.data()), raw.size(), 
+		COMPRESSION_LEVEL) != Z_OK) {
+		return false;
+	}
+	compressed.resize(compressed_size);
+
+	return true;
+}
+
+bool decompress_part(const string& compressed, unsigned long long raw_size, 
+	string& raw) {
+	uLongf decompressed_size{static_cast<uLongf>(raw_size)};
+	raw.resize(raw_size);
+
+	if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &decompressed_size, 
+		reinterpret_cast<const Bytef*>(compressed.data()), 
+		compressed.size()) != Z_OK || decompressed_size != raw_size) {
+		return false;
+	}
+
+	return true;
+}
+
+// Copies in the kernel where the file system allows it, otherwise through 
+// buffer_
+bool copy_range(int source_fd, int destination_fd, long long offset, 
+	long long length, string& buffer_) {
+#ifdef __linux__
+	loff_t source_offset{offset};
+	loff_t destination_offset{offset};
+
+	while (length > 0) {
+		ssize_t bytes_copied{copy_file_range(source_fd, &source_offset, 
+			destination_fd, &destination_offset, length, 0)};
+
+		if (bytes_copied > 0) {
+			length -= bytes_copied;
+		} else if (bytes_copied < 0 && errno == EINTR) {
+			continue;
+		} else if (bytes_copied < 0 && (errno == EXDEV || errno == ENOSYS || 
+			errno == EINVAL || errno == EOPNOTSUPP)) {
+			// Not supported between these files, copied below
+			break;
+		} else {
+			return false;
+		}
+	}
+	offset = source_offset;
+#endif
+
+	while (length > 0) {
+		size_t part_size{static_cast<size_t>(min<long long>(buffer_.size(), 
+			length))};
+		ssize_t bytes_read{pread(source_fd, &buffer_[0], part_size, offset)};
+
+		if (bytes_read <= 0 || 
+			pwrite(destination_fd, buffer_.data(), bytes_read, offset) != 
+			bytes_read) {
+			return false;
+		}
+		offset += bytes_read;
+		length -= bytes_read;
+	}
+
+	return true;
+}
+
+bool copy_local_file(string source_path, string destination_path, 
+	int root_fd) {
+	int source_fd{openat(root_fd, source_path.c_str(), O_RDONLY)};
+	entry_stat stats;
+
+	if (source_fd < 0 || !stat_fd(source_fd, stats)) {
+		close(source_fd);
+		return false;
+	}
+
+	// The destination is only replaced by a complete copy
+	string temporary_path{destination_path + TEMPORARY_SUFFIX};
+	int destination_fd{openat(root_fd, temporary_path.c_str(), 
+		O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+
+	if (destination_fd < 0) {
+		close(source_fd);
+		return false;
+	}
+
+	bool copied{false};
+
+#ifdef FICLONE
+	// Both files share their extents until either is modified (Btrfs, XFS)
+	copied = ioctl(destination_fd, FICLONE, source_fd) == 0;
+#endif
+
+	if (!copied) {
+		copied = true;
+		string buffer_(PART_SIZE, '\0');
+
+		// Holes are recreated by only copying data extents
+		for (const file_extent& extent : data_extents(source_fd, stats.size)) {
+			if (!copy_range(source_fd, destination_fd, extent.offset, 
+				extent.length, buffer_)) {
+				copied = false;
+				break;
+			}
+		}
+
+		if (copied && ftruncate(destination_fd, stats.size) < 0) {
+			copied = false;
+		}
+	}
+
+	copied = copied && fsync(destination_fd) == 0;
+
+	close(source_fd);
+	close(destination_fd);
+
+	if (!copied || renameat(root_fd, temporary_path.c_str(), root_fd, 
+		destination_path.c_str()) != 0) {
+		unlinkat(root_fd, temporary_path.c_str(), 0);
+		return false;
+	}
+
+	return true;
+}
+
+// cache_key identifies the content of the file in the part cache, parts 
+// are only cached while the file still has the size and mtime of stats
+int send_file_parts(Multiplexer& mux, int fd, 
+	const vector<file_extent>& extents, const string& relative_path, 
+	const string& cache_key, const entry_stat& stats, 
+	const send_options& options) {
 	int error_code_{};
 
-	MinimalFileMetadata file_metadata;
-	file_metadata.set_relative_path(relative_path);
-	
-	struct stat stat_;
-	time_t mtime{};
+	PartCache* part_cache{options.part_cache};
+	bool use_cache{part_cache != nullptr && !cache_key.empty()};
+	// Compressed parts are cached separately from raw ones
+	string cache_hash{options.compress ? cache_key + "+zlib" : cache_key};
+	long long session_part_size{options.part_size};
 
+	FileResponse file_response;
+	string compressed_part;
 
-	if (stat(relative_path.c_str(), &stat_) < 0) {
-		return SEND_MTIME_ERR; // can't determine mtime
+	for (const file_extent& extent : extents) {
+		long long extent_end{extent.offset + extent.length};
+
+		for (long long offset{extent.offset}; offset < extent_end;) {
+			shared_ptr<const string> serialized_part;
+
+			if (options.part_sizer != nullptr) {
+				session_part_size = options.part_sizer->next();
+			}
+
+			size_t part_size{static_cast<size_t>(
+				min<long long>(session_part_size, extent_end - offset))};
+
+			if (use_cache) {
+				serialized_part = part_cache->get(relative_path, cache_hash, offset, 
+					part_size);
+			}
+
+			if (!serialized_part) {
+				string* part{file_response.mutable_part()};
+				part->resize(part_size);
+
+				ssize_t bytes_read{pread(fd, &(*part)[0], part_size, offset)};
+
+				if (bytes_read < 0) {
+					return FILE_READ_ERR;
+				}
+				part->resize(bytes_read);
+				file_response.set_digest(sha512_digest(*part));
+
+				if (options.compress) {
+					if (!compress_part(*part, compressed_part)) {
+						return FILE_READ_ERR;
+					}
+					file_response.set_raw_size(bytes_read);
+					part->swap(compressed_part);
+				}
+
+				serialized_part = make_shared<const string>(
+					serialize_proto(file_response));
+
+				// File has been truncated since it was scanned
+				if (static_cast<size_t>(bytes_read) < part_size) {
+					return FILE_READ_ERR;
+				}
+
+				entry_stat current_stats;
+
+				// A file modified while it's sent doesn't match its key anymore
+				if (use_cache && stat_fd(fd, current_stats) && 
+					current_stats.size == stats.size && 
+					current_stats.mtime == stats.mtime) {
+					part_cache->put(relative_path, cache_hash, offset, part_size, 
+						serialized_part);
+				}
+			}
+
+			TRY(mux.send_serialized(Stream::Files, *serialized_part));
+			offset += part_size;
+		}
 	}
 
-	mtime = stat_.st_mtime;
+	return FILE_SEND_OK;
+}
+
+// File data is handed to the kernel with sendfile(), digests are computed 
+// on a mapping of the file. Nothing is copied through userspace.
+int send_file_parts_zero_copy(Multiplexer& mux, int fd, 
+	const vector<file_extent>& extents, const send_options& options) {
+	int error_code_{};
 
-	file_metadata.set_mtime(mtime);
+	if (extents.empty()) {
+		return FILE_SEND_OK;
+	}
 
-	TRY(send_proto(sock, file_metadata));
+	long long mapping_size{extents.back().offset + extents.back().length};
+	void* mapping{mmap(0, mapping_size, PROT_READ, MAP_SHARED, fd, 0)};
+
+	if (mapping == MAP_FAILED) {
+		return FILE_READ_ERR;
+	}
 
 	FileResponse file_response;
+	file_response.set_part("");
+
+	long long session_part_size{options.part_size};
 
-	char byte;
-	unsigned long part_id{0};
-	string part{};
+	for (const file_extent& extent : extents) {
+		long long extent_end{extent.offset + extent.length};
 
-	ifstream file_stream(relative_path, ios_base::binary);
-	while (file_stream) {
-		// Read current byte
-		file_stream.get(byte);
+		for (long long offset{extent.offset}; 
+			error_code_ == 0 && offset < extent_end;) {
+			if (options.part_sizer != nullptr) {
+				session_part_size = options.part_sizer->next();
+			}
+
+			size_t part_size{static_cast<size_t>(
+				min<long long>(session_part_size, extent_end - offset))};
+
+			file_response.set_digest(sha512_digest(
+				static_cast<const char*>(mapping) + offset, part_size));
+			file_response.set_inline_size(part_size);
+
+			error_code_ = mux.send_zero_copy(Stream::Files, file_response, fd, 
+				offset, part_size);
+			offset += part_size;
+		}
+	}
+
+	munmap(mapping, mapping_size);
+
+	return error_code_ > 0 ? error_code_ : FILE_SEND_OK;
+}
+
+unsigned int tuned_part_size(const link_estimate& link) {
+	unsigned int part_size{MIN_PART_SIZE};
+
+	while (part_size < MAX_PART_SIZE && 
+		part_size < link.throughput * TARGET_PART_TIME) {
+		part_size *= 2;
+	}
+
+	return part_size;
+}
+
+PartSizer::PartSizer(int tcp_fd, const link_estimate& link) : 
+	tcp_fd_{tcp_fd}, link_{link}, part_size_{tuned_part_size(link)}, 
+	largest_{part_size_}, next_update_{steady_clock::now()} {}
+
+unsigned int PartSizer::next() {
+	if (tcp_fd_ < 0 || steady_clock::now() < next_update_) {
+		return part_size_;
+	}
+
+	next_update_ = steady_clock::now() + duration_cast<steady_clock::duration>(
+		duration<double>(PART_RETUNE_INTERVAL));
+
+	tcp_link_info info;
+
+	if (!read_tcp_info(tcp_fd_, info)) {
+		return part_size_;
+	}
+
+	double buffered{link_.rtt * link_.throughput};
+
+	if (info.rtt > 0) {
+		link_.rtt = info.rtt;
+	}
+	// A rate limited by the sender only shows that the link is at least 
+	// this fast
+	if (info.delivery_rate > 0 && 
+		(!info.app_limited || info.delivery_rate > link_.throughput)) {
+		link_.throughput = info.delivery_rate;
+	}
+
+	if (link_.rtt * link_.throughput > buffered) {
+		tune_socket(tcp_fd_, link_);
+	}
+
+	part_size_ = tuned_part_size(link_);
+	largest_ = max(largest_, part_size_);
+
+	return part_size_;
+}
 
-		// Append byte to buffer
-		part += byte;
-		// Increment part id
-		part_id++;
+int send_file(Multiplexer& mux, string relative_path, 
+	const send_options& options) {
+	TRACE_SPAN_DETAIL("send_file", relative_path);
 
-		if (part_id == PART_SIZE) {
-			// Dump buffer into protobuf
-			file_response.set_part(part);
+	int error_code_{};
+
+	int fd{openat(options.root_fd, relative_path.c_str(), O_RDONLY)};
+	entry_stat stats;
+
+	if (fd < 0 || !stat_fd(fd, stats)) {
+		close(fd);
+		return SEND_MTIME_ERR; // can't determine mtime
+	}
+
+	MinimalFileMetadata file_metadata;
+	file_metadata.set_relative_path(relative_path);
+	file_metadata.set_mtime(stats.mtime);
+	file_metadata.set_size(stats.size);
+
+	if (!options.hash.empty()) {
+		file_metadata.set_hash(options.hash);
+	}
+
+	// Only data extents are sent, holes are described in the metadata
+	vector<file_extent> extents{data_extents(fd, stats.size)};
+	long long hole_start{0};
+
+	for (const file_extent& extent : extents) {
+		if (extent.offset > hole_start) {
+			FileHole* hole{file_metadata.add_holes()};
+			hole->set_offset(hole_start);
+			hole->set_length(extent.offset - hole_start);
+		}
+		hole_start = extent.offset + extent.length;
+	}
+	if (stats.size > hole_start) {
+		FileHole* hole{file_metadata.add_holes()};
+		hole->set_offset(hole_start);
+		hole->set_length(stats.size - hole_start);
+	}
 
-			TRY(send_proto(sock, file_response));
+	error_code_ = mux.send(Stream::Files, file_metadata);
 
-			// Clear buffer
-			part.clear();
-			// Reset part id
-			part_id = 0;
+	if (error_code_ == SEND_OK) {
+		if (options.zero_copy && !options.compress) {
+			error_code_ = send_file_parts_zero_copy(mux, fd, extents, options);
+		} else {
+			// The hash was taken when the tree was scanned, the size and 
+			// mtime tie the key to what is read now. Paths are only unique 
+			// within a root.
+			string cache_key{format("{}:{}:{}:{}", options.root_fd, stats.size, 
+				stats.mtime, options.hash)};
+
+			error_code_ = send_file_parts(mux, fd, extents, relative_path, 
+				cache_key, stats, options);
 		}
 	}
-	// Dump excess bytes from buffer
-	file_response.set_part(part);
-	TRY(send_proto(sock, file_response));
+	close(fd);
+
+	if (error_code_ == FILE_READ_ERR) {
+		// The receiver removes what it got so far, the session goes on
+		FileResponse aborted;
+		aborted.set_part("");
+		aborted.set_aborted(true);
+
+		TRY(mux.send(Stream::Files, aborted));
+		TRY(send_protocol_separator(mux, Stream::Files));
+
+		return FILE_READ_ERR;
+	} else if (error_code_ > 0) {
+		return error_code_;
+	}
 
 	// Protocol separator indicates file end
-	TRY(send_protocol_separator(sock));
+	TRY(send_protocol_separator(mux, Stream::Files));
 
 	return FILE_SEND_OK;
 }
 
-int send_directory(tcp::socket& sock, string relative_path) {
+int send_file_copy(Multiplexer& mux, string relative_path, 
+	string source_path, time_t mtime) {
+	TRACE_SPAN_DETAIL("send_file_copy", relative_path);
+
+	int error_code_{};
+
+	MinimalFileMetadata file_metadata;
+	file_metadata.set_relative_path(relative_path);
+	file_metadata.set_mtime(mtime);
+	file_metadata.set_copy_from(source_path);
+
+	TRY(mux.send(Stream::Files, file_metadata));
+	TRY(send_protocol_separator(mux, Stream::Files));
+
+	return FILE_SEND_OK;
+}
+
+int send_directory(Multiplexer& mux, string relative_path) {
 	int error_code_{};
 
 	DirectoryRequest dir_response;
 	dir_response.set_relative_path(relative_path);
 
-	TRY(send_proto(sock, dir_response));
+	TRY(mux.send(Stream::Control, dir_response));
 
 	return DIRECTORY_SEND_OK;
 }
 
-int recv_files(tcp::socket& sock) {
+bool safe_relative_path(const string& path) {
+	if (path.empty() || path[0] == '/') {
+		return false;
+	}
+
+	size_t start{0};
+
+	while (start <= path.size()) {
+		size_t end{path.find('/', start)};
+
+		if (end == string::npos) {
+			end = path.size();
+		}
+		if (path.compare(start, end - start, "..") == 0) {
+			return false;
+		}
+		start = end + 1;
+	}
+
+	return true;
+}
+
+// Part of a received file that failed verification
+struct damaged_chunk {
+	string relative_path;
+	long long offset;
+	long long length;
+	time_t mtime;
+	// Whole file hash as advertised by the sender
+	string hash;
+};
+
+// File a writer is working on. Parts are laid out back to back, skipping 
+// over holes. Every part is checked against its digest and the whole file 
+// against the advertised hash while writing.
+struct file_writer {
 	MinimalFileMetadata file_metadata;
-	FileResponse file_response;
-	
-	int meta_recv_error_code{};
-	int file_recv_error_code{};
+	int fd{-1};
+	long long offset{0};
+	int hole_index{0};
+	// Parts failed verification, they are requested again
+	bool damaged{false};
+	// The file couldn't be written, its remaining parts are skipped
+	bool failed{false};
+	// Opened but not closed yet
+	bool unfinished{false};
+	EVP_MD_CTX* ctx{nullptr};
+	// Decompressed parts
+	string raw_part;
+	vector<damaged_chunk> damaged_chunks;
+
+	file_writer() = default;
+	file_writer(const file_writer&) = delete;
+	file_writer& operator=(const file_writer&) = delete;
+
+	// A file is left open if the connection broke while receiving it, see 
+	// discard_unfinished_files()
+	~file_writer() {
+		EVP_MD_CTX_free(ctx);
+
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+};
+
+void open_received_file(file_writer& writer, int root_fd) {
+	const MinimalFileMetadata& file_metadata{writer.file_metadata};
+
+	writer.fd = -1;
+	writer.offset = 0;
+	writer.hole_index = 0;
+	writer.damaged = false;
+	writer.failed = false;
+	writer.unfinished = true;
+
+	if (file_metadata.has_copy_from()) {
+		if (!copy_local_file(file_metadata.copy_from(), 
+			file_metadata.relative_path(), root_fd)) {
+			shared_console->warn("Could not copy '{}' to '{}'.", 
+				file_metadata.copy_from(), file_metadata.relative_path());
+			writer.failed = true;
+		}
+	} else {
+		writer.fd = openat(root_fd, file_metadata.relative_path().c_str(), 
+			O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-	while (true) {
-		meta_recv_error_code = recv_proto(sock, file_metadata);
+		if (writer.fd < 0) {
+			shared_console->warn("Could not open '{}'.", 
+				file_metadata.relative_path());
+			writer.failed = true;
+		}
+	}
+
+	writer.ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(writer.ctx, EVP_sha512(), nullptr);
+}
+
+void write_received_part(file_writer& writer, FileResponse& file_response, 
+	string& raw_part) {
+	TRACE_SPAN("write_part");
+
+	const MinimalFileMetadata& file_metadata{writer.file_metadata};
+	const string* part{&file_response.part()};
+
+	if (file_response.aborted()) {
+		shared_console->warn("'{}' could not be read by the sender.", 
+			file_metadata.relative_path());
+		writer.failed = true;
+	}
+
+	if (writer.failed) {
+		return;
+	}
 
-		if (meta_recv_error_code == PROTO_TYPE_OK) {
-			shared_console->debug("Receiving file '{}'", 
+	while (writer.hole_index < file_metadata.holes_size() && 
+		file_metadata.holes(writer.hole_index).offset() <= writer.offset) {
+		const FileHole& hole{file_metadata.holes(writer.hole_index)};
+		long long hole_end{hole.offset() + hole.length()};
+
+		if (hole_end > writer.offset) {
+			digest_zeros(writer.ctx, hole_end - writer.offset);
+			writer.offset = hole_end;
+		}
+		writer.hole_index++;
+	}
+
+	if (file_response.has_raw_size()) {
+		long long raw_size{static_cast<long long>(file_response.raw_size())};
+
+		if (file_response.raw_size() > MAX_PART_SIZE) {
+			shared_console->warn("Part at offset {} of '{}' is too large.", 
+				writer.offset, file_metadata.relative_path());
+			writer.failed = true;
+			return;
+		}
+
+		// Requested again like any other damaged part, the whole file is 
+		// verified after the repair
+		if (!decompress_part(file_response.part(), raw_size, 
+			writer.raw_part)) {
+			shared_console->warn("Part at offset {} of '{}' could not be "
+				"decompressed.", writer.offset, file_metadata.relative_path());
+
+			writer.damaged_chunks.push_back({file_metadata.relative_path(), 
+				writer.offset, raw_size, file_metadata.mtime(), 
+				file_metadata.hash()});
+			writer.damaged = true;
+			writer.offset += raw_size;
+			return;
+		}
+		part = &writer.raw_part;
+	} else if (file_response.has_inline_size()) {
+		part = &raw_part;
+	}
+
+	if (file_response.has_digest() && 
+		sha512_digest(*part) != file_response.digest()) {
+		shared_console->warn("Part at offset {} of '{}' is damaged.", 
+			writer.offset, file_metadata.relative_path());
+
+		writer.damaged_chunks.push_back({file_metadata.relative_path(), 
+			writer.offset, static_cast<long long>(part->size()), 
+			file_metadata.mtime(), file_metadata.hash()});
+		writer.damaged = true;
+	}
+
+	if (pwrite(writer.fd, part->data(), part->size(), writer.offset) != 
+		static_cast<ssize_t>(part->size())) {
+		shared_console->warn("Could not write to '{}'.", 
+			file_metadata.relative_path());
+		writer.failed = true;
+		return;
+	}
+	EVP_DigestUpdate(writer.ctx, part->data(), part->size());
+	writer.offset += part->size();
+}
+
+void close_received_file(file_writer& writer, int root_fd) {
+	TRACE_SPAN("close_file");
+
+	const MinimalFileMetadata& file_metadata{writer.file_metadata};
+
+	writer.unfinished = false;
+
+	// Trailing holes
+	if (file_metadata.has_size() && !writer.failed) {
+		digest_zeros(writer.ctx, file_metadata.size() - writer.offset);
+
+		if (writer.fd >= 0 && ftruncate(writer.fd, file_metadata.size()) < 0) {
+			shared_console->warn("Could not resize '{}'.", 
 				file_metadata.relative_path());
+			writer.failed = true;
+		}
+	}
 
-			bool all_parts_received{false};
-			ofstream file_stream;
+	string hash{hex_digest(writer.ctx)};
+	EVP_MD_CTX_free(writer.ctx);
+	writer.ctx = nullptr;
 
-			file_stream.open(file_metadata.relative_path(), ios::out | ios::app);
+	if (writer.failed) {
+		// Size and mtime would pass the next quick check with the wrong 
+		// content, the file is removed and transferred again instead. A file 
+		// that couldn't be opened is left as it was.
+		bool modified{writer.fd >= 0 || file_metadata.has_copy_from()};
 
-			while (!all_parts_received) {
-				file_recv_error_code = recv_proto(sock, file_response);
-				
-				if (file_recv_error_code == PROTO_TYPE_STAGE_END) {
-					all_parts_received = true;
-				} else if (file_recv_error_code == PROTO_TYPE_OK) {
-					file_stream << file_response.part();
-				} else {
-					return file_recv_error_code;
-				}
-			}
-			file_stream.close();
-			if (!set_mtime(file_metadata.mtime(), file_metadata.relative_path())) {
-				shared_console->warn("Could not set mtime for '{}'.", 
-					file_metadata.relative_path());
+		close(writer.fd);
+		writer.fd = -1;
+
+		while (!writer.damaged_chunks.empty() && 
+			writer.damaged_chunks.back().relative_path == 
+			file_metadata.relative_path()) {
+			writer.damaged_chunks.pop_back();
+		}
+
+		if (modified && unlinkat(root_fd, file_metadata.relative_path().c_str(), 
+			0) == 0) {
+			shared_console->warn("Removed '{}', it could not be written.", 
+				file_metadata.relative_path());
+		}
+		return;
+	}
+
+	// Damaged files are verified again after they have been repaired
+	if (!writer.damaged && file_metadata.has_hash() && 
+		hash != file_metadata.hash()) {
+		shared_console->warn("'{}' does not match its advertised hash, "
+			"it has probably been modified during transmission.", 
+			file_metadata.relative_path());
+	}
+
+	// Damaged files get their mtime once all parts have been repaired, 
+	// copies are only known by path
+	struct timespec times[2]{{0, UTIME_OMIT}, {file_metadata.mtime(), 0}};
+	bool mtime_set{writer.damaged || (writer.fd >= 0 ? 
+		futimens(writer.fd, times) == 0 : set_mtime(file_metadata.mtime(), 
+		file_metadata.relative_path(), root_fd))};
+
+	if (!mtime_set) {
+		shared_console->warn("Could not set mtime for '{}'.", 
+			file_metadata.relative_path());
+	}
+
+	close(writer.fd);
+	writer.fd = -1;
+}
+
+void handle_write_job(write_job& job, file_writer& writer, int root_fd) {
+	switch (job.type) {
+		case WriteJobType::Open:
+			writer.file_metadata.Swap(&job.file_metadata);
+			open_received_file(writer, root_fd);
+			break;
+		case WriteJobType::Part:
+			write_received_part(writer, job.file_response, job.raw_part);
+			break;
+		case WriteJobType::Close:
+			close_received_file(writer, root_fd);
+			break;
+	}
+}
+
+int repair_chunks(Multiplexer& mux, vector<damaged_chunk>& damaged_chunks, 
+	int root_fd) {
+	TRACE_SPAN("repair_chunks");
+
+	int error_code_{};
+
+	for (const damaged_chunk& chunk : damaged_chunks) {
+		ChunkRequest chunk_request;
+		chunk_request.set_relative_path(chunk.relative_path);
+		chunk_request.set_offset(chunk.offset);
+		chunk_request.set_length(chunk.length);
+
+		TRY(mux.send(Stream::ChunkRequests, chunk_request));
+	}
+
+	TRY(send_protocol_separator(mux, Stream::ChunkRequests));
+
+	FileResponse file_response;
+	// First chunk of every file, the chunks of a file are adjacent
+	vector<const damaged_chunk*> repaired_files;
+	vector<bool> repaired;
+
+	for (const damaged_chunk& chunk : damaged_chunks) {
+		error_code_ = mux.recv(Stream::Repairs, file_response);
+
+		if (error_code_ != PROTO_TYPE_OK) {
+			return error_code_ > 0 ? error_code_ : PROTO_TYPE_WRONG;
+		}
+
+		if (repaired_files.empty() || 
+			repaired_files.back()->relative_path != chunk.relative_path) {
+			repaired_files.push_back(&chunk);
+			repaired.push_back(true);
+		}
+
+		if (!file_response.has_digest() || file_response.offset() != chunk.offset || 
+			file_response.part().size() != static_cast<size_t>(chunk.length) || 
+			sha512_digest(file_response.part()) != file_response.digest()) {
+			shared_console->warn("Could not repair part at offset {} of '{}'.", 
+				chunk.offset, chunk.relative_path);
+			repaired.back() = false;
+			continue;
+		}
+
+		int fd{openat(root_fd, chunk.relative_path.c_str(), O_WRONLY)};
+
+		if (fd < 0 || pwrite(fd, file_response.part().data(), 
+			file_response.part().size(), chunk.offset) != 
+			static_cast<ssize_t>(file_response.part().size())) {
+			shared_console->warn("Could not write repaired part of '{}'.", 
+				chunk.relative_path);
+			repaired.back() = false;
+		}
+		close(fd);
+	}
+
+	// Separator that terminates the repaired chunks
+	if (mux.recv(Stream::Repairs, file_response) != PROTO_TYPE_STAGE_END) {
+		return PROTO_TYPE_WRONG;
+	}
+
+	for (size_t i{0}; i < repaired_files.size(); i++) {
+		const damaged_chunk* chunk{repaired_files[i]};
+
+		// Same as a file that couldn't be written, see close_received_file()
+		if (!repaired[i]) {
+			if (unlinkat(root_fd, chunk->relative_path.c_str(), 0) == 0) {
+				shared_console->warn("Removed '{}', it could not be repaired.", 
+					chunk->relative_path);
 			}
-		} else if (meta_recv_error_code == PROTO_TYPE_STAGE_END) {
+			continue;
+		}
+
+		if (!set_mtime(chunk->mtime, chunk->relative_path, root_fd)) {
+			shared_console->warn("Could not set mtime for '{}'.", 
+				chunk->relative_path);
+		}
+
+		if (chunk->hash.empty()) {
+			continue;
+		}
+
+		// Rare, the whole file is read again
+		int fd{openat(root_fd, chunk->relative_path.c_str(), O_RDONLY)};
+		entry_stat stats;
+
+		if (fd >= 0 && stat_fd(fd, stats) && 
+			sha512_hash_file(fd, stats.size) != chunk->hash) {
+			shared_console->warn("'{}' does not match its advertised hash "
+				"after repair.", chunk->relative_path);
+		}
+		close(fd);
+	}
+
+	return CHUNK_REPAIR_OK;
+}
+
+// Paths come from the peer and are checked before anything is opened
+bool valid_received_file(const MinimalFileMetadata& file_metadata, 
+	const recv_options& options) {
+	if (!safe_relative_path(file_metadata.relative_path())) {
+		return false;
+	}
+	if (file_metadata.has_copy_from() && (!options.allow_copies || 
+		!safe_relative_path(file_metadata.copy_from()))) {
+		return false;
+	}
+
+	return options.expected_paths == nullptr || 
+		options.expected_paths->count(file_metadata.relative_path()) > 0;
+}
+
+// The session broke off. Files that were being received or still wait 
+// for repairs have a fresh mtime, they would overwrite the good copy of the 
+// sender next time. They are removed and transferred again instead.
+void discard_unfinished_files(vector<file_writer>& writers, int root_fd) {
+	unordered_set<string> paths;
+
+	for (file_writer& writer : writers) {
+		// Same as in close_received_file(), files that couldn't be opened 
+		// are left as they were
+		if (writer.unfinished && (writer.fd >= 0 || 
+			writer.file_metadata.has_copy_from())) {
+			paths.insert(writer.file_metadata.relative_path());
+		}
+		if (writer.fd >= 0) {
+			close(writer.fd);
+			writer.fd = -1;
+		}
+		writer.unfinished = false;
+
+		for (const damaged_chunk& chunk : writer.damaged_chunks) {
+			paths.insert(chunk.relative_path);
+		}
+	}
+
+	for (const string& path : paths) {
+		if (unlinkat(root_fd, path.c_str(), 0) == 0) {
+			shared_console->warn("Removed '{}', it was not received "
+				"completely.", path);
+		}
+	}
+}
+
+int recv_files(Multiplexer& mux, const recv_options& options) {
+	vector<file_writer> writers(max(options.writers, 1u));
+	WritePool pool{options.writers, options.write_buffer_size, 
+		[&](write_job& job, unsigned int writer) {
+			handle_write_job(job, writers[writer], options.root_fd);
+		}};
+
+	write_job job;
+	int error_code_{};
+
+	// Nothing is left behind that looks like a complete file
+	auto abort = [&](int error_code) {
+		pool.finish();
+		discard_unfinished_files(writers, options.root_fd);
+
+		return error_code;
+	};
+
+	// Only receives, writing is up to the pool
+	while (true) {
+		error_code_ = mux.recv(Stream::Files, job.file_metadata);
+
+		if (error_code_ == PROTO_TYPE_STAGE_END) {
 			break;
-		} else {
-			return meta_recv_error_code;
+		} else if (error_code_ != PROTO_TYPE_OK) {
+			return abort(error_code_);
+		}
+
+		if (!valid_received_file(job.file_metadata, options)) {
+			shared_console->error("Rejected file '{}', it wasn't requested or "
+				"lies outside the sync root.", job.file_metadata.relative_path());
+			return abort(PROTO_TYPE_WRONG);
 		}
+
+		TRACE_SPAN_DETAIL("recv_file", job.file_metadata.relative_path());
+
+		shared_console->debug("Receiving file '{}'", 
+			job.file_metadata.relative_path());
+
+		job.type = WriteJobType::Open;
+		job.size = 0;
+		pool.submit(job);
+
+		while (true) {
+			error_code_ = mux.recv(Stream::Files, job.file_response, 
+				job.raw_part);
+
+			if (error_code_ == PROTO_TYPE_STAGE_END) {
+				job.type = WriteJobType::Close;
+				job.size = 0;
+				pool.submit(job);
+				break;
+			} else if (error_code_ != PROTO_TYPE_OK) {
+				return abort(error_code_);
+			}
+
+			job.type = WriteJobType::Part;
+			job.size = job.file_response.part().size() + job.raw_part.size();
+			pool.submit(job);
+		}
+	}
+
+	pool.finish();
+
+	vector<damaged_chunk> damaged_chunks;
+
+	for (file_writer& writer : writers) {
+		damaged_chunks.insert(damaged_chunks.end(), 
+			writer.damaged_chunks.begin(), writer.damaged_chunks.end());
 	}
 
-	return FILE_RECV_OK;
+	error_code_ = repair_chunks(mux, damaged_chunks, options.root_fd);
+
+	if (error_code_ != CHUNK_REPAIR_OK) {
+		discard_unfinished_files(writers, options.root_fd);
+	}
+
+	return error_code_;
+}
+
+// Requests come from the peer, only parts of files sent in this session 
+// are read
+bool valid_chunk_request(const ChunkRequest& request, 
+	const unordered_set<string>& sent_paths, unsigned int part_size) {
+	return safe_relative_path(request.relative_path()) && 
+		sent_paths.count(request.relative_path()) > 0 && 
+		request.offset() >= 0 && request.length() > 0 && 
+		request.length() <= part_size;
 }
 
-int send_protocol_separator(tcp::socket& sock) {
+int serve_chunk_requests(Multiplexer& mux, 
+	const unordered_set<string>& sent_paths, unsigned int part_size, 
+	int root_fd) {
+	TRACE_SPAN("serve_chunk_requests");
+
 	int error_code_{};
 
-	ProtocolSeparator protocol_stage_complete;
-	TRY(send_proto(sock, protocol_stage_complete));
+	ChunkRequest chunk_request;
+	vector<ChunkRequest> chunk_requests;
+
+	while (true) {
+		error_code_ = mux.recv(Stream::ChunkRequests, chunk_request);
+
+		if (error_code_ == PROTO_TYPE_STAGE_END) {
+			break;
+		} else if (error_code_ != PROTO_TYPE_OK) {
+			return error_code_ > 0 ? error_code_ : PROTO_TYPE_WRONG;
+		}
+		chunk_requests.push_back(chunk_request);
+	}
+
+	FileResponse file_response;
+
+	for (const ChunkRequest& request : chunk_requests) {
+		shared_console->debug("Part at offset {} of '{}' requested again", 
+			request.offset(), request.relative_path());
 
-	return PROTO_SEPARATOR_SEND_OK;
-}
\ No newline at end of file
+		file_response.Clear();
+		file_response.set_offset(request.offset());
+		file_response.set_part("");
+
+		int fd{-1};
+		entry_stat stats;
+
+		if (!valid_chunk_request(request, sent_paths, part_size)) {
+			shared_console->warn("Refusing to resend {} B at offset {} of '{}'.", 
+				request.length(), request.offset(), request.relative_path());
+		} else {
+			fd = openat(root_fd, request.relative_path().c_str(), O_RDONLY);
+		}
+
+		// Without a digest the receiver discards the part
+		if (fd >= 0 && stat_fd(fd, stats) && request.offset() < stats.size) {
+			string* part{file_response.mutable_part()};
+			part->resize(request.length());
+
+			ssize_t bytes_read{pread(fd, &(*part)[0], request.length(), 
+				request.offset())};
+
+			if (bytes_read == request.length()) {
+				file_response.set_digest(sha512_digest(*part));
+			} else {
+				part->clear();
+			}
+		}
+		close(fd);
+
+		TRY(mux.send(Stream::Repairs, file_response));
+	}
+
+	TRY(send_protocol_separator(mux, Stream::Repairs));
+
+	return CHUNK_REPAIR_OK;
+}
@@ -0,0 +1,46 @@
+#include "tcp_info.h"
+
+#include <cstddef>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#endif
+
+bool read_tcp_info(int fd, tcp_link_info& info) {
+#ifdef __linux__
+	tcp_info kernel_info{};
+	socklen_t info_size{sizeof(kernel_info)};
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &kernel_info, &info_size) != 0) {
+		return false;
+	}
+
+	info.rtt = kernel_info.tcpi_rtt / 1e6;
+	info.delivery_rate = 0;
+	info.app_limited = true;
+	info.bytes_acked = 0;
+	info.bytes_received = 0;
+
+	if (info_size >= offsetof(tcp_info, tcpi_bytes_received) + 
+		sizeof(kernel_info.tcpi_bytes_received)) {
+		info.bytes_acked = kernel_info.tcpi_bytes_acked;
+		info.bytes_received = kernel_info.tcpi_bytes_received;
+	}
+
+	// Older kernels return a shorter structure without the rate
+	if (info_size >= offsetof(tcp_info, tcpi_delivery_rate) + 
+		sizeof(kernel_info.tcpi_delivery_rate)) {
+		info.delivery_rate = static_cast<double>(kernel_info.tcpi_delivery_rate);
+		info.app_limited = kernel_info.tcpi_delivery_rate_app_limited;
+	}
+
+	return true;
+#else
+	(void) fd;
+	(void) info;
+
+	return false;
+#endif
+}
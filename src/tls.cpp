@@ -0,0 +1,363 @@
+#include "tls.h"
+
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "asio.hpp"
+#include "spdlog/spdlog.h"
+
+using std::string;
+using std::thread;
+
+using asio::ip::tcp;
+using asio::error_code;
+
+using spdlog::stdout_color_mt;
+
+auto tls_console{stdout_color_mt("tls")};
+
+// Size of the buffers used by the userspace relay (maximum TLS record size)
+const int RELAY_BUFFER_SIZE{16384};
+
+void log_tls_errors(string message) {
+	char buffer[256];
+
+	tls_console->error(message);
+
+	for (unsigned long error{ERR_get_error()}; error != 0; 
+		error = ERR_get_error()) {
+		ERR_error_string_n(error, buffer, sizeof(buffer));
+		tls_console->error("  {}", buffer);
+	}
+}
+
+void enable_ktls(SSL_CTX* ctx, bool kernel) {
+#ifdef SSL_OP_ENABLE_KTLS
+	if (kernel) {
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	} else {
+		SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+	}
+#else
+	(void) ctx;
+	(void) kernel;
+#endif
+}
+
+SSL_CTX* create_tls_server_context(string certificate_path, string key_path, 
+	bool kernel) {
+	SSL_CTX* ctx{SSL_CTX_new(TLS_server_method())};
+
+	if (ctx == nullptr) {
+		log_tls_errors("Could not create TLS context.");
+		return nullptr;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	// Post-handshake messages can't be handled once the kernel owns the 
+	// receiving side
+	SSL_CTX_set_num_tickets(ctx, 0);
+	enable_ktls(ctx, kernel);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, certificate_path.c_str()) != 1 || 
+		SSL_CTX_use_PrivateKey_file(ctx, key_path.c_str(), 
+			SSL_FILETYPE_PEM) != 1) {
+		log_tls_errors("Could not load certificate or key.");
+		SSL_CTX_free(ctx);
+		return nullptr;
+	}
+
+	return ctx;
+}
+
+SSL_CTX* create_tls_client_context(string ca_path, bool kernel) {
+	SSL_CTX* ctx{SSL_CTX_new(TLS_client_method())};
+
+	if (ctx == nullptr) {
+		log_tls_errors("Could not create TLS context.");
+		return nullptr;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	enable_ktls(ctx, kernel);
+
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+
+	if ((ca_path.empty() ? SSL_CTX_set_default_verify_paths(ctx) : 
+		SSL_CTX_load_verify_locations(ctx, ca_path.c_str(), nullptr)) != 1) {
+		log_tls_errors("Could not load CA certificates.");
+		SSL_CTX_free(ctx);
+		return nullptr;
+	}
+
+	return ctx;
+}
+
+TlsSession::~TlsSession() {
+	if (reader_) {
+		error_code error_code_;
+
+		// Stops the relay, it's either writing to the reader ...
+		reader_->close(error_code_);
+
+		// ... or waiting for the network
+		shutdown(network_fd_, SHUT_RD);
+	}
+	if (relay_thread_.joinable()) {
+		relay_thread_.join();
+	}
+	if (ssl_ != nullptr) {
+		SSL_free(ssl_);
+	}
+	if (network_fd_ >= 0) {
+		close(network_fd_);
+	}
+	if (relay_fd_ >= 0) {
+		close(relay_fd_);
+	}
+}
+
+int TlsSession::start(tcp::socket& sock, SSL_CTX* ctx, bool server, 
+	string peer_address) {
+	ssl_ = SSL_new(ctx);
+
+	if (ssl_ == nullptr) {
+		log_tls_errors("Could not create TLS session.");
+		return TLS_CONTEXT_ERR;
+	}
+
+	if (!peer_address.empty()) {
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl_), peer_address.c_str());
+	}
+
+	SSL_set_fd(ssl_, sock.native_handle());
+
+	if ((server ? SSL_accept(ssl_) : SSL_connect(ssl_)) != 1) {
+		log_tls_errors("TLS handshake failed.");
+		return TLS_HANDSHAKE_ERR;
+	}
+
+	kernel_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+	kernel_ = kernel_send_ && BIO_get_ktls_recv(SSL_get_rbio(ssl_)) && 
+		SSL_pending(ssl_) == 0;
+
+	if (kernel_) {
+		return TLS_OK;
+	}
+
+	// Userspace relay: the network side moves into the relay thread, the 
+	// socket is replaced by one end of a socket pair. asio doesn't care 
+	// about the address family for reads and writes.
+	int pair[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		return TLS_CONTEXT_ERR;
+	}
+
+	network_fd_ = dup(sock.native_handle());
+	relay_fd_ = pair[1];
+
+	error_code error_code_;
+
+	if (kernel_send_) {
+		// The socket keeps sending through the kernel. The relay reads from 
+		// a duplicate that outlives the socket, the BIO keeps its kTLS state.
+		BIO_set_fd(SSL_get_rbio(ssl_), network_fd_, BIO_NOCLOSE);
+
+		reader_.reset(new tcp::socket{sock.get_executor()});
+		reader_->assign(tcp::v4(), pair[0], error_code_);
+
+		relay_thread_ = thread{&TlsSession::relay_received, this};
+
+		return TLS_OK;
+	}
+
+	SSL_set_fd(ssl_, network_fd_);
+	SSL_set_mode(ssl_, SSL_MODE_ENABLE_PARTIAL_WRITE | 
+		SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	sock.close(error_code_);
+	sock.assign(tcp::v4(), pair[0], error_code_);
+
+	// Records are flushed as soon as they are complete
+	int no_delay{1};
+	setsockopt(network_fd_, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+	fcntl(network_fd_, F_SETFL, fcntl(network_fd_, F_GETFL) | O_NONBLOCK);
+	fcntl(relay_fd_, F_SETFL, fcntl(relay_fd_, F_GETFL) | O_NONBLOCK);
+
+	relay_thread_ = thread{&TlsSession::relay, this};
+
+	return TLS_OK;
+}
+
+bool TlsSession::kernel() const {
+	return kernel_;
+}
+
+bool TlsSession::kernel_send() const {
+	return kernel_send_;
+}
+
+tcp::socket& TlsSession::reader(tcp::socket& sock) {
+	return reader_ ? *reader_ : sock;
+}
+
+int TlsSession::network_fd(tcp::socket& sock) const {
+	return network_fd_ >= 0 ? network_fd_ : sock.native_handle();
+}
+
+void TlsSession::relay() {
+	// Decrypted data on its way to the application and vice versa
+	string to_application;
+	string to_network;
+	char buffer[RELAY_BUFFER_SIZE];
+
+	bool network_open{true};
+	bool application_open{true};
+
+	while (network_open || !to_application.empty()) {
+		bool progress{false};
+		short network_events{0};
+		short relay_events{0};
+
+		// Network -> application
+		if (network_open && to_application.empty()) {
+			int bytes_read{SSL_read(ssl_, buffer, sizeof(buffer))};
+
+			if (bytes_read > 0) {
+				to_application.assign(buffer, bytes_read);
+				progress = true;
+			} else {
+				int error{SSL_get_error(ssl_, bytes_read)};
+
+				if (error == SSL_ERROR_WANT_READ) {
+					network_events |= POLLIN;
+				} else if (error == SSL_ERROR_WANT_WRITE) {
+					network_events |= POLLOUT;
+				} else {
+					network_open = false;
+				}
+			}
+		}
+
+		if (!to_application.empty()) {
+			ssize_t bytes_written{write(relay_fd_, to_application.data(), 
+				to_application.size())};
+
+			if (bytes_written > 0) {
+				to_application.erase(0, bytes_written);
+				progress = true;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				relay_events |= POLLOUT;
+			} else {
+				// Application is gone
+				break;
+			}
+		}
+
+		// Peer is gone and everything it sent has been delivered
+		if (!network_open && to_application.empty()) {
+			break;
+		}
+
+		// Application -> network
+		if (application_open && to_network.empty()) {
+			ssize_t bytes_read{read(relay_fd_, buffer, sizeof(buffer))};
+
+			if (bytes_read > 0) {
+				to_network.assign(buffer, bytes_read);
+				progress = true;
+			} else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				relay_events |= POLLIN;
+			} else {
+				application_open = false;
+			}
+		}
+
+		if (!to_network.empty() && network_open) {
+			int bytes_written{SSL_write(ssl_, to_network.data(), 
+				static_cast<int>(to_network.size()))};
+
+			if (bytes_written > 0) {
+				to_network.erase(0, bytes_written);
+				progress = true;
+			} else {
+				int error{SSL_get_error(ssl_, bytes_written)};
+
+				if (error == SSL_ERROR_WANT_WRITE) {
+					network_events |= POLLOUT;
+				} else if (error == SSL_ERROR_WANT_READ) {
+					network_events |= POLLIN;
+				} else {
+					network_open = false;
+				}
+			}
+		}
+
+		if (!application_open && to_network.empty()) {
+			// Everything the application wrote has been sent
+			break;
+		}
+
+		if (!progress) {
+			pollfd fds[2]{{network_fd_, network_events, 0}, 
+				{relay_fd_, relay_events, 0}};
+
+			poll(fds, 2, -1);
+		}
+	}
+
+	if (network_open) {
+		SSL_shutdown(ssl_);
+	}
+
+	// Lets the application see the end of the connection
+	shutdown(relay_fd_, SHUT_RDWR);
+}
+
+void TlsSession::relay_received() {
+	char buffer[RELAY_BUFFER_SIZE];
+	int bytes_read;
+
+	// Both descriptors block, the destructor shuts them down. Nothing is 
+	// sent from here, the socket's writes would interleave with it.
+	while ((bytes_read = SSL_read(ssl_, buffer, sizeof(buffer))) > 0) {
+		for (int offset{0}; offset < bytes_read;) {
+			ssize_t bytes_written{send(relay_fd_, buffer + offset, 
+				bytes_read - offset, MSG_NOSIGNAL)};
+
+			if (bytes_written > 0) {
+				offset += bytes_written;
+			} else if (bytes_written < 0 && errno != EINTR) {
+				// Application is gone
+				return;
+			}
+		}
+	}
+
+	// Lets the application see the end of the connection
+	shutdown(relay_fd_, SHUT_RDWR);
+}
+
+string repr_tls_session(const TlsSession* session) {
+	if (session == nullptr) {
+		return "plaintext";
+	}
+	if (session->kernel()) {
+		return "kernel TLS";
+	}
+	return session->kernel_send() ? "kernel TLS (sending)" : "userspace TLS";
+}
@@ -0,0 +1,285 @@
+#include "trace.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+
+#include <unistd.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wconversion"
+
+#include "spdlog/spdlog.h"
+#include "fmt/format.h"
+
+#pragma GCC diagnostic pop
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::make_shared;
+using std::mutex;
+using std::lock_guard;
+using std::ofstream;
+using std::min;
+using std::remove_if;
+
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+
+using spdlog::stdout_color_mt;
+
+using fmt::format;
+
+auto trace_console{stdout_color_mt("trace")};
+
+atomic<bool> tracing{false};
+steady_clock::time_point trace_epoch;
+string trace_path;
+
+// Only taken when a thread records its first span, is named, or when
+// the buffers are dumped
+mutex registry_mtx;
+vector<shared_ptr<TraceBuffer>> registry;
+unsigned int next_thread_id{1};
+
+// Drained events that belong to sessions which haven't been dumped yet
+struct pending_event {
+	unsigned int thread_id;
+	trace_event event;
+};
+
+vector<pending_event> pending_events;
+
+// Marks the buffer of an exiting thread, it's released once drained
+struct thread_trace {
+	shared_ptr<TraceBuffer> buffer;
+
+	~thread_trace() {
+		if (buffer) {
+			buffer->retired.store(true, std::memory_order_release);
+		}
+	}
+};
+
+thread_local thread_trace local_trace;
+thread_local unsigned long long local_session{0};
+
+TraceBuffer& local_buffer() {
+	if (!local_trace.buffer) {
+		lock_guard<mutex> guard{registry_mtx};
+
+		local_trace.buffer = make_shared<TraceBuffer>(next_thread_id++);
+		registry.push_back(local_trace.buffer);
+	}
+
+	return *local_trace.buffer;
+}
+
+TraceBuffer::TraceBuffer(unsigned int thread_id) : thread_id_{thread_id} {}
+
+bool TraceBuffer::push(const trace_event& event) {
+	unsigned long long head{head_.load(std::memory_order_relaxed)};
+
+	if (head - tail_.load(std::memory_order_acquire) >= TRACE_BUFFER_EVENTS) {
+		return false;
+	}
+
+	unique_ptr<trace_event[]>& block{
+		blocks_[head % TRACE_BUFFER_EVENTS / TRACE_BLOCK_EVENTS]};
+
+	if (!block) {
+		block.reset(new trace_event[TRACE_BLOCK_EVENTS]);
+	}
+
+	slot(head) = event;
+	head_.store(head + 1, std::memory_order_release);
+
+	return true;
+}
+
+void enable_trace(const string& path) {
+	char directory[4096];
+
+	trace_path = path;
+
+	if (path.compare(0, 1, "/") != 0 && 
+		getcwd(directory, sizeof(directory)) != nullptr) {
+		trace_path = string(directory) + "/" + path;
+	}
+
+	trace_epoch = steady_clock::now();
+	tracing.store(true, std::memory_order_release);
+}
+
+bool trace_enabled() {
+	return tracing.load(std::memory_order_acquire);
+}
+
+void name_trace_thread(const string& name) {
+	if (!trace_enabled()) {
+		return;
+	}
+
+	TraceBuffer& buffer{local_buffer()};
+
+	lock_guard<mutex> guard{registry_mtx};
+	buffer.thread_name = name;
+}
+
+void set_trace_session(unsigned long long session) {
+	local_session = session;
+}
+
+unsigned long long trace_session() {
+	return local_session;
+}
+
+TraceSpan::TraceSpan(const char* name) : buffer_{nullptr} {
+	if (!tracing.load(std::memory_order_relaxed)) {
+		return;
+	}
+
+	buffer_ = &local_buffer();
+	event_.name = name;
+	event_.detail[0] = '\0';
+	event_.session = local_session;
+	start_ = steady_clock::now();
+}
+
+TraceSpan::~TraceSpan() {
+	if (buffer_ == nullptr) {
+		return;
+	}
+
+	steady_clock::time_point end{steady_clock::now()};
+
+	event_.start = duration_cast<nanoseconds>(start_ - trace_epoch).count();
+	event_.duration = duration_cast<nanoseconds>(end - start_).count();
+
+	if (!buffer_->push(event_)) {
+		buffer_->dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void TraceSpan::set_detail(const string& detail) {
+	size_t length{min<size_t>(detail.size(), TRACE_DETAIL_SIZE)};
+
+	// Multibyte characters aren't cut in half
+	if (length < detail.size()) {
+		while (length > 0 && (static_cast<unsigned char>(detail[length]) &
+			0xc0) == 0x80) {
+			length--;
+		}
+	}
+
+	memcpy(event_.detail, detail.data(), length);
+	event_.detail[length] = '\0';
+}
+
+string escape_json(const char* text) {
+	string escaped;
+
+	for (; *text != '\0'; text++) {
+		unsigned char character{static_cast<unsigned char>(*text)};
+
+		if (character == '"' || character == '\\') {
+			escaped += '\\';
+			escaped += static_cast<char>(character);
+		} else if (character < 0x20) {
+			escaped += format("\\u{:04x}", character);
+		} else {
+			escaped += static_cast<char>(character);
+		}
+	}
+
+	return escaped;
+}
+
+void write_trace_event(ofstream& trace_file, int pid, unsigned int thread_id, 
+	const trace_event& event, bool& first) {
+	trace_file << (first ? "" : ",") << format("\n{{\"name\":\"{}\","
+		"\"cat\":\"dir_sync\",\"ph\":\"X\",\"pid\":{},\"tid\":{},"
+		"\"ts\":{:.3f},\"dur\":{:.3f}", event.name, pid, thread_id, 
+		event.start / 1000.0, event.duration / 1000.0);
+
+	if (event.detail[0] != '\0') {
+		trace_file << format(",\"args\":{{\"detail\":\"{}\"}}",
+			escape_json(event.detail));
+	}
+	trace_file << "}";
+	first = false;
+}
+
+bool dump_trace(const string& suffix, unsigned long long session) {
+	if (!trace_enabled()) {
+		return false;
+	}
+
+	string path{trace_path + suffix};
+	ofstream trace_file(path, std::ios::trunc);
+
+	if (!trace_file) {
+		trace_console->warn("Could not open '{}'.", path);
+		return false;
+	}
+
+	int pid{getpid()};
+	bool first{true};
+
+	trace_file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+	lock_guard<mutex> guard{registry_mtx};
+
+	for (const shared_ptr<TraceBuffer>& buffer : registry) {
+		if (!buffer->thread_name.empty()) {
+			trace_file << (first ? "" : ",") << format("\n{{\"name\":"
+				"\"thread_name\",\"ph\":\"M\",\"pid\":{},\"tid\":{},\"args\":"
+				"{{\"name\":\"{}\"}}}}", pid, buffer->thread_id(),
+				escape_json(buffer->thread_name.c_str()));
+			first = false;
+		}
+
+		buffer->drain([&](const trace_event& event) {
+			pending_events.push_back({buffer->thread_id(), event});
+		});
+
+		unsigned long long dropped{buffer->dropped.exchange(0)};
+
+		if (dropped > 0) {
+			trace_console->warn("{} events of thread {} were dropped, its "
+				"buffer was full.", dropped, buffer->thread_id());
+		}
+	}
+
+	// Events of other sessions stay, in the order they were drained
+	auto kept{pending_events.begin()};
+
+	for (const pending_event& pending : pending_events) {
+		if (session == 0 || pending.event.session == session) {
+			write_trace_event(trace_file, pid, pending.thread_id, 
+				pending.event, first);
+		} else if (pending.event.session != 0) {
+			*kept++ = pending;
+		}
+	}
+	pending_events.erase(kept, pending_events.end());
+
+	trace_file << "\n]}\n";
+
+	// Threads that exited have nothing left to record
+	registry.erase(remove_if(registry.begin(), registry.end(),
+		[](const shared_ptr<TraceBuffer>& buffer) {
+			return buffer->retired.load(std::memory_order_acquire) && 
+				buffer->drained();
+		}), registry.end());
+
+	return static_cast<bool>(trace_file);
+}
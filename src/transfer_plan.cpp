@@ -0,0 +1,212 @@
+#include "transfer_plan.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "fmt/format.h"
+
+#include "shared.h"
+#include "trace.h"
+
+#include "dir_sync.pb.h"
+
+using std::cout;
+using std::endl;
+
+using std::string;
+using std::vector;
+using std::min;
+using std::unordered_map;
+using std::unordered_set;
+
+using fmt::format;
+
+using dir_sync::FileMetadata;
+
+double sample_compressibility(string relative_path, long long size, 
+	int root_fd) {
+	int fd{openat(root_fd, relative_path.c_str(), O_RDONLY)};
+
+	if (fd < 0) {
+		return 1;
+	}
+
+	string sample(static_cast<size_t>(min<long long>(PART_SIZE, size)), '\0');
+	ssize_t bytes_read{pread(fd, &sample[0], sample.size(), 0)};
+	close(fd);
+
+	string compressed;
+
+	if (bytes_read <= 0) {
+		return 1;
+	}
+	sample.resize(bytes_read);
+
+	if (!compress_part(sample, compressed)) {
+		return 1;
+	}
+
+	return min(1.0, static_cast<double>(compressed.size()) / sample.size());
+}
+
+// Content hash -> path of a file that can serve as a local copy source
+unordered_map<string, string> copy_sources(FileTree& tree, 
+	const vector<string>& overwritten_paths) {
+	unordered_set<string> overwritten(overwritten_paths.begin(), 
+		overwritten_paths.end());
+	unordered_map<string, string> sources;
+
+	// Quick checked files have no hash, their content is unknown
+	for (const FileMetadata& file : tree.files()) {
+		if (!file.hash().empty() && 
+			overwritten.count(file.relative_path()) == 0) {
+			sources.emplace(file.hash(), file.relative_path());
+		}
+	}
+
+	return sources;
+}
+
+unordered_map<string, const FileMetadata*> files_by_path(FileTree& tree) {
+	unordered_map<string, const FileMetadata*> files;
+
+	for (const FileMetadata& file : tree.files()) {
+		files[file.relative_path()] = &file;
+	}
+
+	return files;
+}
+
+// latency is paid by every file that goes over the network but not by 
+// local copies, it decides between the two for small files
+planned_transfer plan_file(const FileMetadata& file, 
+	unordered_map<string, string>& sources, link_estimate link, 
+	double latency, bool compressible, int root_fd) {
+	unsigned long long size{static_cast<unsigned long long>(file.size())};
+
+	planned_transfer planned{file.relative_path(), TransferStrategy::WholeFile, 
+		"", size, latency + size / link.throughput};
+
+	auto source = sources.find(file.hash());
+
+	if (source != sources.end()) {
+		double copy_time{size / LOCAL_COPY_SPEED};
+
+		if (copy_time < planned.predicted_time) {
+			planned.strategy = TransferStrategy::LocalCopy;
+			planned.copy_from = source->second;
+			planned.predicted_bytes = 0;
+			planned.predicted_time = copy_time;
+		}
+	}
+
+	if (compressible && planned.strategy == TransferStrategy::WholeFile && 
+		file.size() >= MIN_COMPRESSION_SIZE) {
+		double ratio{sample_compressibility(file.relative_path(), file.size(), 
+			root_fd)};
+		unsigned long long compressed_size{
+			static_cast<unsigned long long>(size * ratio)};
+		double compressed_time{latency + size / COMPRESSION_SPEED + 
+			compressed_size / link.throughput};
+
+		if (compressed_time < planned.predicted_time) {
+			planned.strategy = TransferStrategy::Compressed;
+			planned.predicted_bytes = compressed_size;
+			planned.predicted_time = compressed_time;
+		}
+	}
+
+	return planned;
+}
+
+transfer_plan plan_sends(vector<string> file_sends, FileTree& master_tree, 
+	FileTree& slave_tree, link_estimate link, int root_fd) {
+	TRACE_SPAN("plan_sends");
+
+	transfer_plan plan;
+
+	// Files are received in order, sources that are about to be replaced 
+	// can't be relied upon
+	unordered_map<string, string> sources{copy_sources(slave_tree, file_sends)};
+	unordered_map<string, const FileMetadata*> master_files{
+		files_by_path(master_tree)};
+
+	for (const string& file_path : file_sends) {
+		auto file = master_files.find(file_path);
+
+		// Sent files arrive half a round trip later
+		if (file != master_files.end()) {
+			plan.push_back(plan_file(*file->second, sources, link, 
+				link.rtt / 2, true, root_fd));
+		}
+	}
+
+	return plan;
+}
+
+transfer_plan plan_requests(vector<string> file_requests, 
+	FileTree& master_tree, FileTree& slave_tree, link_estimate link) {
+	TRACE_SPAN("plan_requests");
+
+	transfer_plan plan;
+
+	// Local copies are made before any requested file is received
+	unordered_map<string, string> sources{copy_sources(master_tree, {})};
+	unordered_map<string, const FileMetadata*> slave_files{
+		files_by_path(slave_tree)};
+
+	for (const string& file_path : file_requests) {
+		auto file = slave_files.find(file_path);
+
+		// Requested files take a whole round trip
+		if (file != slave_files.end()) {
+			plan.push_back(plan_file(*file->second, sources, link, link.rtt, 
+				false, AT_FDCWD));
+		}
+	}
+
+	return plan;
+}
+
+string repr_transfer_strategy(TransferStrategy strategy) {
+	switch (strategy) {
+		case TransferStrategy::WholeFile:
+			return "whole";
+		case TransferStrategy::Compressed:
+			return "zlib";
+		case TransferStrategy::LocalCopy:
+			return "copy";
+	}
+	return "unknown";
+}
+
+void print_transfer_plan(transfer_plan& plan, string title) {
+	unsigned long long total_bytes{0};
+	double total_time{0};
+
+	cout << title << endl;
+
+	for (const planned_transfer& planned : plan) {
+		cout << format("  {:<6} {:>14} B {:>10.3f} s  {}", 
+			repr_transfer_strategy(planned.strategy), planned.predicted_bytes, 
+			planned.predicted_time, planned.relative_path);
+
+		if (planned.strategy == TransferStrategy::LocalCopy) {
+			cout << format(" <- {}", planned.copy_from);
+		}
+		cout << endl;
+
+		total_bytes += planned.predicted_bytes;
+		total_time += planned.predicted_time;
+	}
+
+	cout << format("  {} files, {} B, {:.3f} s", plan.size(), total_bytes, 
+		total_time) << endl;
+}
@@ -0,0 +1,139 @@
+#include "tree_diff.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "trace.h"
+
+#include "dir_sync.pb.h"
+
+using std::string;
+using std::vector;
+using std::unordered_map;
+using std::unordered_set;
+
+using dir_sync::FileMetadata;
+using dir_sync::DirectoryMetadata;
+
+bool same_content(const FileMetadata& a, const FileMetadata& b) {
+	if (!a.hash().empty() && !b.hash().empty()) {
+		return a.hash() == b.hash();
+	}
+
+	return a.size() == b.size() && a.mtime() == b.mtime();
+}
+
+vector<string> ambiguous_files(const FileTree& master_tree, 
+	const FileTree& slave_tree) {
+	unordered_map<string, const FileMetadata*> slave_files;
+	vector<string> ambiguous;
+
+	for (const FileMetadata& slave_file : slave_tree.files()) {
+		slave_files[slave_file.relative_path()] = &slave_file;
+	}
+
+	for (const FileMetadata& master_file : master_tree.files()) {
+		auto slave_file = slave_files.find(master_file.relative_path());
+
+		if (slave_file != slave_files.end() && 
+			slave_file->second->size() == master_file.size() && 
+			slave_file->second->mtime() != master_file.mtime() && 
+			(slave_file->second->hash().empty() || master_file.hash().empty())) {
+			ambiguous.push_back(master_file.relative_path());
+		}
+	}
+
+	return ambiguous;
+}
+
+vector<const FileMetadata*> identical_files(const FileTree& master_tree, 
+	const FileTree& slave_tree) {
+	unordered_map<string, const FileMetadata*> slave_files;
+	vector<const FileMetadata*> identical;
+
+	for (const FileMetadata& slave_file : slave_tree.files()) {
+		if (!slave_file.hash().empty()) {
+			slave_files[slave_file.relative_path()] = &slave_file;
+		}
+	}
+
+	for (const FileMetadata& master_file : master_tree.files()) {
+		auto slave_file = slave_files.find(master_file.relative_path());
+
+		if (!master_file.hash().empty() && slave_file != slave_files.end() && 
+			slave_file->second->hash() == master_file.hash() && 
+			slave_file->second->mtime() != master_file.mtime()) {
+			identical.push_back(&master_file);
+		}
+	}
+
+	return identical;
+}
+
+file_tree_file_diff diff_file_tree_files(
+	FileTree& master_tree, FileTree& slave_tree) {
+	TRACE_SPAN("diff_file_tree_files");
+
+	vector<string> file_sends;
+	vector<string> file_requests;
+
+	// Both trees are indexed by path, the diff stays linear
+	unordered_map<string, const FileMetadata*> slave_files;
+	unordered_set<string> master_paths;
+
+	for (const FileMetadata& slave_file : slave_tree.files()) {
+		slave_files[slave_file.relative_path()] = &slave_file;
+	}
+
+	for (const FileMetadata& master_file : master_tree.files()) {
+		auto slave_file = slave_files.find(master_file.relative_path());
+
+		master_paths.insert(master_file.relative_path());
+
+		if (slave_file == slave_files.end()) {
+			// Send file
+			file_sends.push_back(master_file.relative_path());
+		} else if (!same_content(*slave_file->second, master_file)) {
+			if (slave_file->second->mtime() < master_file.mtime()) {
+				// Send file
+				file_sends.push_back(master_file.relative_path());
+			} else if (slave_file->second->mtime() > master_file.mtime()) {
+				// Request file
+				file_requests.push_back(master_file.relative_path());
+			}
+		}
+	}
+
+	// Request files that are in slave tree but not in master tree
+	for (const FileMetadata& slave_file : slave_tree.files()) {
+		if (master_paths.count(slave_file.relative_path()) == 0) {
+			// Request file
+			file_requests.push_back(slave_file.relative_path());
+		}
+	}
+
+	return {file_sends, file_requests};
+}
+
+file_tree_dir_diff diff_file_tree_directories(
+	FileTree& master_tree, FileTree& slave_tree) {
+	TRACE_SPAN("diff_file_tree_directories");
+
+	vector<string> folder_requests;
+	unordered_set<string> slave_directories;
+
+	for (const DirectoryMetadata& slave_dir : slave_tree.directories()) {
+		slave_directories.insert(slave_dir.relative_path());
+	}
+
+	for (const DirectoryMetadata& master_dir : master_tree.directories()) {
+		if (slave_directories.count(master_dir.relative_path()) == 0) {
+			// Request folder creation
+			folder_requests.push_back(master_dir.relative_path());
+		}
+	}
+
+	return folder_requests;
+}
@@ -0,0 +1,170 @@
+#include "write_pool.h"
+
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+#include "trace.h"
+
+using std::string;
+using std::unique_lock;
+using std::lock_guard;
+using std::max;
+
+using std::chrono::milliseconds;
+
+void write_job::swap(write_job& other) {
+	std::swap(type, other.type);
+	file_metadata.Swap(&other.file_metadata);
+	file_response.Swap(&other.file_response);
+	raw_part.swap(other.raw_part);
+	std::swap(size, other.size);
+}
+
+WriteQueue::WriteQueue() : jobs_{new write_job[WRITE_QUEUE_SLOTS]} {}
+
+bool WriteQueue::push(write_job& job) {
+	unsigned long long head{head_.load(std::memory_order_relaxed)};
+
+	if (head - tail_.load(std::memory_order_acquire) >= WRITE_QUEUE_SLOTS) {
+		return false;
+	}
+
+	jobs_[head % WRITE_QUEUE_SLOTS].swap(job);
+	head_.store(head + 1, std::memory_order_release);
+
+	return true;
+}
+
+bool WriteQueue::pop(write_job& job) {
+	unsigned long long tail{tail_.load(std::memory_order_relaxed)};
+
+	if (tail == head_.load(std::memory_order_acquire)) {
+		return false;
+	}
+
+	job.swap(jobs_[tail % WRITE_QUEUE_SLOTS]);
+	tail_.store(tail + 1, std::memory_order_release);
+
+	return true;
+}
+
+WritePool::WritePool(unsigned int writers, unsigned long long memory_budget,
+	job_handler handler) : writer_count_{max(writers, 1u)},
+	memory_budget_{memory_budget}, handler_{handler} {
+	for (unsigned int i{0}; i < writer_count_; i++) {
+		queues_.emplace_back(new WriteQueue());
+	}
+	// Writers record their events for the session that receives
+	unsigned long long session{trace_session()};
+
+	for (unsigned int i{0}; i < writer_count_; i++) {
+		threads_.emplace_back([this, i, session]() {
+			TRACE_THREAD_NAME("writer");
+			TRACE_SESSION(session);
+
+			run(i);
+		});
+	}
+}
+
+WritePool::~WritePool() {
+	finish();
+}
+
+template <typename F>
+void WritePool::wait_until(F ready) {
+	while (!ready()) {
+		sleepers_++;
+
+		unique_lock<mutex> lock{sleep_mtx_};
+
+		// Wakers take the lock before notifying, a job that arrived since
+		// the first check is seen here
+		bool done{ready()};
+
+		if (!done) {
+			sleep_cv_.wait_for(lock, milliseconds(WRITE_POOL_POLL_INTERVAL));
+		}
+
+		lock.unlock();
+		sleepers_--;
+
+		if (done) {
+			return;
+		}
+	}
+}
+
+void WritePool::wake() {
+	if (sleepers_.load() > 0) {
+		lock_guard<mutex> guard{sleep_mtx_};
+		sleep_cv_.notify_all();
+	}
+}
+
+void WritePool::submit(write_job& job) {
+	if (job.type == WriteJobType::Open) {
+		current_writer_ = next_writer_;
+		next_writer_ = (next_writer_ + 1) % writer_count_;
+	}
+
+	unsigned long long size{job.size};
+
+	// A single part larger than the budget is let through on its own
+	wait_until([&]() {
+		unsigned long long queued_bytes{queued_bytes_.load()};
+
+		return queued_bytes == 0 || queued_bytes + size <= memory_budget_;
+	});
+	queued_bytes_ += size;
+
+	WriteQueue& queue{*queues_[current_writer_]};
+
+	wait_until([&]() { return queue.push(job); });
+	wake();
+}
+
+void WritePool::finish() {
+	if (threads_.empty()) {
+		return;
+	}
+
+	finishing_ = true;
+	wake();
+
+	for (thread& thread_ : threads_) {
+		thread_.join();
+	}
+	threads_.clear();
+}
+
+void WritePool::run(unsigned int writer) {
+	WriteQueue& queue{*queues_[writer]};
+	write_job job;
+
+	while (true) {
+		bool popped{false};
+
+		wait_until([&]() {
+			popped = queue.pop(job);
+
+			return popped || finishing_.load();
+		});
+
+		// Jobs are submitted before finishing_ is set, one last look
+		if (!popped && !queue.pop(job)) {
+			return;
+		}
+
+		unsigned long long size{job.size};
+
+		handler_(job, writer);
+
+		// Buffers are freed, slots of the queue don't hold on to them
+		write_job().swap(job);
+
+		queued_bytes_ -= size;
+		wake();
+	}
+}
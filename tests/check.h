@@ -0,0 +1,30 @@
+#pragma once
+
+#include <iostream>
+#include <atomic>
+
+// Minimal assertions for the unit tests in tests/, every test is its own
+// executable. A failed check is reported and the test carries on, main()
+// returns check_result() so that ctest sees the failure.
+#define CHECK(condition) \
+	check(static_cast<bool>(condition), #condition, __FILE__, __LINE__)
+
+// Checks may run on threads the test starts
+std::atomic<int> check_failures{0};
+
+inline void check(bool passed, const char* condition, const char* file,
+	int line) {
+	if (!passed) {
+		std::cerr << file << ":" << line << ": check failed: " << condition
+			<< std::endl;
+		check_failures++;
+	}
+}
+
+inline int check_result() {
+	if (check_failures > 0) {
+		std::cerr << check_failures << " check(s) failed" << std::endl;
+	}
+
+	return check_failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,227 @@
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "asio.hpp"
+
+#include "multiplexer.h"
+#include "networking.h"
+
+#include "check.h"
+
+using std::string;
+using std::thread;
+using std::atomic;
+
+using asio::io_context;
+using asio::ip::address_v4;
+using asio::buffer;
+using asio::error_code;
+
+// Both ends of a loopback connection
+struct connection {
+	io_context ctx;
+	tcp::socket local{ctx};
+	tcp::socket remote{ctx};
+
+	connection() {
+		tcp::acceptor acceptor{ctx, tcp::endpoint{address_v4::loopback(), 0}};
+
+		local.connect(acceptor.local_endpoint());
+		acceptor.accept(remote);
+	}
+};
+
+FileRequest request_of(const string& path) {
+	FileRequest request;
+
+	request.set_relative_path(path);
+
+	return request;
+}
+
+// Frame header as read_frame() expects it, nothing follows
+void write_header(tcp::socket& sock, u_int8_t stream, u_int64_t raw_size,
+	MessageType type, u_int64_t message_size) {
+	char header[2 * (U_INT_8_SIZE + U_INT_64_SIZE)];
+	u_int8_t type_byte{static_cast<u_int8_t>(type)};
+
+	memcpy(&header[0], &stream, U_INT_8_SIZE);
+	memcpy(&header[U_INT_8_SIZE], &raw_size, U_INT_64_SIZE);
+	memcpy(&header[U_INT_8_SIZE + U_INT_64_SIZE], &type_byte, U_INT_8_SIZE);
+	memcpy(&header[2 * U_INT_8_SIZE + U_INT_64_SIZE], &message_size,
+		U_INT_64_SIZE);
+
+	error_code error_code_;
+	asio::write(sock, buffer(header), error_code_);
+}
+
+// File of length bytes, closed again on destruction
+struct temporary_file {
+	FILE* file;
+	int fd;
+
+	explicit temporary_file(size_t length, char fill) : file{tmpfile()},
+		fd{fileno(file)} {
+		string data(length, fill);
+
+		CHECK(write(fd, data.data(), length) == static_cast<ssize_t>(length));
+	}
+
+	~temporary_file() { fclose(file); }
+};
+
+void test_streams_and_results() {
+	connection peers;
+	Multiplexer sender{peers.local};
+	Multiplexer receiver{peers.remote};
+
+	CHECK(sender.send(Stream::Files, request_of("files 1")) == SEND_OK);
+	CHECK(sender.send(Stream::Control, request_of("control")) == SEND_OK);
+	CHECK(sender.send(Stream::Files, request_of("files 2")) == SEND_OK);
+	CHECK(send_protocol_separator(sender, Stream::Files) == SEND_OK);
+	CHECK(sender.send(Stream::Files, LinkProbe()) == SEND_OK);
+
+	// Frames of other streams are queued for their receivers, in order
+	FileRequest request;
+
+	CHECK(receiver.recv(Stream::Control, request) == PROTO_TYPE_OK);
+	CHECK(request.relative_path() == "control");
+	CHECK(receiver.recv(Stream::Files, request) == PROTO_TYPE_OK);
+	CHECK(request.relative_path() == "files 1");
+	CHECK(receiver.recv(Stream::Files, request) == PROTO_TYPE_OK);
+	CHECK(request.relative_path() == "files 2");
+	CHECK(receiver.recv(Stream::Files, request) == PROTO_TYPE_STAGE_END);
+	CHECK(receiver.recv(Stream::Files, request) == PROTO_TYPE_WRONG);
+}
+
+void test_zero_copy() {
+	connection peers;
+	Multiplexer sender{peers.local};
+	Multiplexer receiver{peers.remote};
+	temporary_file file{4096, 'z'};
+
+	CHECK(sender.send_zero_copy(Stream::Files, request_of("part"), file.fd,
+		1000, 2000) == SEND_OK);
+
+	FileRequest request;
+	string raw;
+
+	CHECK(receiver.recv(Stream::Files, request, raw) == PROTO_TYPE_OK);
+	CHECK(request.relative_path() == "part");
+	CHECK(raw == string(2000, 'z'));
+}
+
+// A refused header closes the connection for every receiver
+void check_refused(u_int8_t stream, u_int64_t raw_size,
+	u_int64_t message_size) {
+	connection peers;
+	Multiplexer receiver{peers.remote};
+
+	write_header(peers.local, stream, raw_size, MessageType::FileRequest,
+		message_size);
+
+	FileRequest request;
+
+	CHECK(receiver.recv(Stream::Control, request) == ASIO_ERROR);
+	CHECK(receiver.recv(Stream::Files, request) == ASIO_ERROR);
+}
+
+void test_frame_caps() {
+	check_refused(STREAM_COUNT, 0, 0);
+	check_refused(0, MAX_RAW_SIZE + 1, 0);
+	check_refused(0, 0, MAX_MESSAGE_SIZE + 1);
+
+	// Right at the caps frames are accepted, the data is read
+	connection peers;
+	Multiplexer sender{peers.local};
+	Multiplexer receiver{peers.remote};
+	temporary_file file{MAX_RAW_SIZE, 'r'};
+
+	thread sending{[&]() {
+		CHECK(sender.send_zero_copy(Stream::Repairs, request_of("largest"),
+			file.fd, 0, MAX_RAW_SIZE) == SEND_OK);
+	}};
+
+	FileRequest request;
+	string raw;
+
+	CHECK(receiver.recv(Stream::Repairs, request, raw) == PROTO_TYPE_OK);
+	CHECK(raw.size() == MAX_RAW_SIZE);
+
+	sending.join();
+}
+
+void test_backpressure() {
+	connection peers;
+	Multiplexer sender{peers.local};
+	Multiplexer receiver{peers.remote};
+	// Two of these fill the queue of a stream
+	size_t part_size{MAX_QUEUED_BYTES / 2 + 1};
+	temporary_file file{part_size, 'p'};
+
+	thread sending{[&]() {
+		for (int i{0}; i < 3; i++) {
+			CHECK(sender.send_zero_copy(Stream::Files, request_of("part"),
+				file.fd, 0, part_size) == SEND_OK);
+		}
+		CHECK(sender.send(Stream::Control, request_of("control")) == SEND_OK);
+	}};
+
+	atomic<bool> control_received{false};
+
+	thread controlling{[&]() {
+		FileRequest request;
+
+		CHECK(receiver.recv(Stream::Control, request) == PROTO_TYPE_OK);
+		CHECK(request.relative_path() == "control");
+		control_received = true;
+	}};
+
+	// The control frame is only read once the files stream is drained a bit
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	CHECK(!control_received);
+
+	for (int i{0}; i < 3; i++) {
+		FileRequest request;
+		string raw;
+
+		CHECK(receiver.recv(Stream::Files, request, raw) == PROTO_TYPE_OK);
+		CHECK(raw.size() == part_size);
+	}
+
+	controlling.join();
+	sending.join();
+
+	CHECK(control_received);
+}
+
+void test_shutdown() {
+	connection peers;
+	Multiplexer receiver{peers.remote};
+
+	thread waiting{[&]() {
+		FileRequest request;
+
+		CHECK(receiver.recv(Stream::Control, request) == ASIO_ERROR);
+	}};
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	receiver.shutdown();
+	waiting.join();
+}
+
+int main() {
+	test_streams_and_results();
+	test_zero_copy();
+	test_frame_caps();
+	test_backpressure();
+	test_shutdown();
+
+	return check_result();
+}
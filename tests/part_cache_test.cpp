@@ -0,0 +1,93 @@
+#include <string>
+#include <memory>
+
+#include "part_cache.h"
+
+#include "check.h"
+
+using std::string;
+using std::shared_ptr;
+using std::make_shared;
+
+shared_ptr<const string> part_of(size_t size, char fill='x') {
+	return make_shared<const string>(size, fill);
+}
+
+void test_keys() {
+	PartCache cache{1000};
+
+	cache.put("a", "h1", 0, 100, part_of(100));
+
+	CHECK(cache.get("a", "h1", 0, 100) != nullptr);
+	// Every component of the key counts
+	CHECK(cache.get("b", "h1", 0, 100) == nullptr);
+	CHECK(cache.get("a", "h2", 0, 100) == nullptr);
+	CHECK(cache.get("a", "h1", 100, 100) == nullptr);
+	CHECK(cache.get("a", "h1", 0, 50) == nullptr);
+}
+
+void test_lru_eviction() {
+	PartCache cache{300};
+
+	cache.put("a", "h", 0, 100, part_of(100, 'a'));
+	cache.put("b", "h", 0, 100, part_of(100, 'b'));
+	cache.put("c", "h", 0, 100, part_of(100, 'c'));
+	CHECK(cache.size() == 300);
+
+	// "a" becomes the most recently used, "b" is evicted next
+	CHECK(cache.get("a", "h", 0, 100) != nullptr);
+	cache.put("d", "h", 0, 100, part_of(100, 'd'));
+
+	CHECK(cache.size() == 300);
+	CHECK(cache.get("b", "h", 0, 100) == nullptr);
+	CHECK(cache.get("a", "h", 0, 100) != nullptr);
+	CHECK(cache.get("c", "h", 0, 100) != nullptr);
+	CHECK(cache.get("d", "h", 0, 100) != nullptr);
+
+	// A large part evicts as many as needed
+	cache.put("e", "h", 0, 250, part_of(250, 'e'));
+
+	CHECK(cache.size() == 250);
+	CHECK(cache.get("e", "h", 0, 250) != nullptr);
+	CHECK(cache.get("d", "h", 0, 100) == nullptr);
+}
+
+void test_oversized_and_duplicates() {
+	PartCache cache{100};
+
+	cache.put("a", "h", 0, 101, part_of(101));
+	CHECK(cache.size() == 0);
+	CHECK(cache.get("a", "h", 0, 101) == nullptr);
+
+	shared_ptr<const string> first{part_of(60, '1')};
+
+	cache.put("a", "h", 0, 60, first);
+	// The part that is already cached is kept and not counted twice
+	cache.put("a", "h", 0, 60, part_of(60, '2'));
+
+	CHECK(cache.size() == 60);
+	CHECK(cache.get("a", "h", 0, 60) == first);
+}
+
+void test_evicted_parts_stay_valid() {
+	PartCache cache{100};
+
+	cache.put("a", "h", 0, 100, part_of(100, 'a'));
+
+	shared_ptr<const string> sending{cache.get("a", "h", 0, 100)};
+
+	cache.put("b", "h", 0, 100, part_of(100, 'b'));
+
+	CHECK(cache.get("a", "h", 0, 100) == nullptr);
+	CHECK(sending != nullptr && *sending == string(100, 'a'));
+	CHECK(cache.size() == 100);
+}
+
+int main() {
+	test_keys();
+	test_lru_eviction();
+	test_oversized_and_duplicates();
+	test_evicted_parts_stay_valid();
+
+	return check_result();
+}
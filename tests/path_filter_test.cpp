@@ -0,0 +1,138 @@
+#include <string>
+#include <vector>
+
+#include "path_filter.h"
+
+#include "check.h"
+
+using std::string;
+using std::vector;
+
+PathFilter filter_of(const vector<string>& rules) {
+	PathFilter filter;
+
+	for (const string& rule : rules) {
+		filter.add_rule(rule);
+	}
+
+	return filter;
+}
+
+void test_glob_match() {
+	CHECK(glob_match("*.o", "main.o"));
+	CHECK(!glob_match("*.o", "main.oo"));
+	CHECK(!glob_match("*.o", "src/main.o"));
+	CHECK(glob_match("a?c", "abc"));
+	CHECK(!glob_match("a?c", "a/c"));
+	CHECK(!glob_match("a?c", "ac"));
+
+	// "**" crosses directories, "**/" also matches none
+	CHECK(glob_match("docs/**/*.md", "docs/a.md"));
+	CHECK(glob_match("docs/**/*.md", "docs/a/b/c.md"));
+	CHECK(!glob_match("docs/**/*.md", "src/docs/a.md"));
+	CHECK(glob_match("build/**", "build/a/b"));
+	CHECK(glob_match("**.log", "a/b.log"));
+
+	CHECK(glob_match("[abc].txt", "b.txt"));
+	CHECK(!glob_match("[abc].txt", "d.txt"));
+	CHECK(glob_match("[!abc].txt", "d.txt"));
+	CHECK(!glob_match("[^abc].txt", "a.txt"));
+	CHECK(glob_match("v[0-9]", "v7"));
+	CHECK(!glob_match("v[0-9]", "vx"));
+	CHECK(glob_match("[]]", "]"));
+	CHECK(!glob_match("a[/]b", "a/b"));
+	// Unterminated classes match a literal '['
+	CHECK(glob_match("a[b", "a[b"));
+
+	CHECK(glob_match("\\*", "*"));
+	CHECK(!glob_match("\\*", "a"));
+	CHECK(glob_match("\\[x]", "[x]"));
+}
+
+void test_empty() {
+	PathFilter filter;
+
+	CHECK(filter.empty());
+	CHECK(!filter.excluded("anything", false));
+	CHECK(!filter.excluded_recursive("a/b/c", true));
+
+	// Rules that reduce to nothing are dropped
+	filter.add_rule("!");
+	filter.add_rule("/");
+	CHECK(filter.empty());
+}
+
+void test_names_and_anchors() {
+	PathFilter filter{filter_of({"*.o", "node_modules", "/docs/*.md",
+		"src/gen"})};
+
+	// Unanchored rules match names at any depth
+	CHECK(filter.excluded("main.o", false));
+	CHECK(filter.excluded("a/b/main.o", false));
+	CHECK(filter.excluded("web/node_modules", true));
+	CHECK(filter.excluded("node_modules", false));
+	CHECK(!filter.excluded("node_modules_old", true));
+
+	// Anchored rules match the whole path, a leading '/' is dropped
+	CHECK(filter.excluded("docs/a.md", false));
+	CHECK(!filter.excluded("docs/sub/a.md", false));
+	CHECK(!filter.excluded("x/docs/a.md", false));
+	CHECK(filter.excluded("src/gen", true));
+	CHECK(!filter.excluded("lib/src/gen", true));
+}
+
+void test_directory_only() {
+	PathFilter filter{filter_of({"build/", "cache*/"})};
+
+	CHECK(filter.excluded("build", true));
+	CHECK(!filter.excluded("build", false));
+	CHECK(filter.excluded("a/cache1", true));
+	CHECK(!filter.excluded("a/cache1", false));
+}
+
+void test_last_rule_wins() {
+	// Literals and globs are looked up separately, their order still counts
+	PathFilter keep{filter_of({"*.log", "!keep.log"})};
+
+	CHECK(keep.excluded("a.log", false));
+	CHECK(!keep.excluded("keep.log", false));
+	CHECK(!keep.excluded("a/keep.log", false));
+
+	PathFilter drop{filter_of({"!keep.log", "*.log"})};
+
+	CHECK(drop.excluded("keep.log", false));
+
+	PathFilter globs{filter_of({"*.log", "!k*.log", "kill.log"})};
+
+	CHECK(globs.excluded("a.log", false));
+	CHECK(!globs.excluded("keep.log", false));
+	CHECK(globs.excluded("kill.log", false));
+
+	// A directory-only rule doesn't take part for files
+	PathFilter mixed{filter_of({"tmp", "!tmp/"})};
+
+	CHECK(mixed.excluded("tmp", false));
+	CHECK(!mixed.excluded("tmp", true));
+}
+
+void test_recursive() {
+	PathFilter filter{filter_of({"build/", "!build/keep"})};
+
+	CHECK(!filter.excluded("build/x/y.c", false));
+	CHECK(filter.excluded_recursive("build/x/y.c", false));
+	CHECK(filter.excluded_recursive("src/build/y.c", false));
+	CHECK(!filter.excluded_recursive("src/y.c", false));
+	// Re-including a path below an excluded directory has no effect
+	CHECK(filter.excluded_recursive("build/keep", false));
+}
+
+int main() {
+	test_glob_match();
+	test_empty();
+	test_names_and_anchors();
+	test_directory_only();
+	test_last_rule_wins();
+	test_recursive();
+
+	return check_result();
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Syncs the same root twice through one server process. The second session
+# has to see the files of the first: nothing is transferred again and a
+# newer edit on the server wins over the client's older copy.
+#
+# Usage: sync_root_twice.sh <dir_sync_server> <dir_sync_client> [port]
+
+SERVER=$1
+CLIENT=$2
+PORT=${3:-40197}
+
+WORK=$(mktemp -d) || exit 1
+SERVER_PID=
+
+cleanup() {
+	[ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID"
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $1"
+	echo "--- server log"; cat "$WORK/server.log"
+	exit 1
+}
+
+mkdir -p "$WORK/server/sub" "$WORK/client"
+echo one > "$WORK/server/edited"
+echo two > "$WORK/server/sub/kept"
+echo three > "$WORK/client/uploaded"
+touch -d '2020-01-01' "$WORK/server/edited" "$WORK/server/sub/kept" \
+	"$WORK/client/uploaded"
+
+"$SERVER" "$WORK/server" -p "$PORT" --verbose >> "$WORK/server.log" 2>&1 &
+SERVER_PID=$!
+sleep 0.5
+
+"$CLIENT" "$WORK/client" 127.0.0.1 -p "$PORT" > "$WORK/client1.log" 2>&1 || \
+	fail "first session"
+diff -r -x .dir_sync "$WORK/server" "$WORK/client" > /dev/null || \
+	fail "trees differ after the first session"
+
+# Only the server's copy changes between the sessions
+echo newer > "$WORK/server/edited"
+touch -d '2021-01-01' "$WORK/server/edited"
+: > "$WORK/server.log"
+
+"$CLIENT" "$WORK/client" 127.0.0.1 -p "$PORT" > "$WORK/client2.log" 2>&1 || \
+	fail "second session"
+
+[ "$(cat "$WORK/server/edited")" = newer ] || \
+	fail "the server's newer edit was overwritten"
+[ "$(cat "$WORK/client/edited")" = newer ] || \
+	fail "the server's newer edit did not reach the client"
+grep -q "Receiving file" "$WORK/server.log" && \
+	fail "the server requested files it already has"
+diff -r -x .dir_sync "$WORK/server" "$WORK/client" > /dev/null || \
+	fail "trees differ after the second session"
+
+exit 0
@@ -0,0 +1,181 @@
+#include <string>
+#include <set>
+
+#include "journal.h"
+
+#include "dir_sync.pb.h"
+
+#include "check.h"
+
+using std::string;
+using std::set;
+using std::to_string;
+
+using dir_sync::FileMetadata;
+using dir_sync::DirectoryMetadata;
+
+void add_file(FileTree& tree, const string& path, long long mtime,
+	long long size, const string& hash="") {
+	FileMetadata* file{tree.add_files()};
+
+	file->set_relative_path(path);
+	file->set_mtime(mtime);
+	file->set_size(size);
+	file->set_hash(hash);
+}
+
+void add_directory(FileTree& tree, const string& path) {
+	tree.add_directories()->set_relative_path(path);
+}
+
+// Entries of a tree regardless of their order
+set<string> entries(const FileTree& tree) {
+	set<string> result;
+
+	for (const DirectoryMetadata& directory : tree.directories()) {
+		result.insert("d:" + directory.relative_path());
+	}
+	for (const FileMetadata& file : tree.files()) {
+		result.insert("f:" + file.relative_path() + ":" +
+			to_string(file.mtime()) + ":" + to_string(file.size()) + ":" +
+			file.hash());
+	}
+
+	return result;
+}
+
+FileTree base_tree() {
+	FileTree tree;
+
+	add_directory(tree, "a");
+	add_directory(tree, "a/b");
+	add_directory(tree, "gone");
+	add_directory(tree, "swap_to_file");
+	add_file(tree, "a/one", 100, 1);
+	add_file(tree, "a/b/two", 100, 2, "h2");
+	add_file(tree, "gone/three", 100, 3);
+	add_file(tree, "same", 100, 4);
+	add_file(tree, "swap_to_directory", 100, 5);
+
+	return tree;
+}
+
+FileTree changed_tree() {
+	FileTree tree;
+
+	add_directory(tree, "a/b");
+	add_directory(tree, "a");
+	add_directory(tree, "new");
+	add_directory(tree, "swap_to_directory");
+	add_file(tree, "same", 100, 4);
+	add_file(tree, "a/b/two", 100, 2, "h2 changed");
+	add_file(tree, "a/one", 200, 1);
+	add_file(tree, "new/four", 100, 6);
+	add_file(tree, "swap_to_file", 100, 7);
+
+	return tree;
+}
+
+void test_round_trip() {
+	FileTree base{base_tree()};
+	FileTree tree{changed_tree()};
+
+	string sender_digest{tree_digest(base)};
+	string receiver_digest{tree_digest(base)};
+
+	FileTree delta{tree_delta(base, tree, &sender_digest)};
+	FileTree applied{apply_tree_delta(base, delta, &receiver_digest)};
+
+	CHECK(entries(applied) == entries(tree));
+	CHECK(sender_digest == tree_digest(tree));
+	CHECK(receiver_digest == tree_digest(tree));
+
+	// Only changes are sent
+	CHECK(delta.files_size() == 4);
+	CHECK(delta.directories_size() == 2);
+	CHECK(delta.removed_files_size() == 2);
+	CHECK(delta.removed_directories_size() == 2);
+}
+
+void test_unchanged() {
+	FileTree base{base_tree()};
+	string digest{tree_digest(base)};
+
+	FileTree delta{tree_delta(base, base, &digest)};
+
+	CHECK(delta.files_size() == 0);
+	CHECK(delta.directories_size() == 0);
+	CHECK(delta.removed_files_size() == 0);
+	CHECK(delta.removed_directories_size() == 0);
+	CHECK(digest == tree_digest(base));
+	CHECK(entries(apply_tree_delta(base, delta)) == entries(base));
+}
+
+void test_from_empty() {
+	FileTree empty;
+	FileTree tree{changed_tree()};
+	string digest{tree_digest(empty)};
+
+	FileTree delta{tree_delta(empty, tree, &digest)};
+
+	CHECK(entries(delta) == entries(tree));
+	CHECK(digest == tree_digest(tree));
+	CHECK(entries(apply_tree_delta(empty, delta)) == entries(tree));
+
+	// And back
+	FileTree removal{tree_delta(tree, empty, &digest)};
+
+	CHECK(apply_tree_delta(tree, removal).files_size() == 0);
+	CHECK(digest == tree_digest(empty));
+}
+
+void test_digest() {
+	FileTree tree{base_tree()};
+	FileTree reordered;
+
+	for (int i{tree.files_size() - 1}; i >= 0; i--) {
+		*reordered.add_files() = tree.files(i);
+	}
+	for (int i{tree.directories_size() - 1}; i >= 0; i--) {
+		*reordered.add_directories() = tree.directories(i);
+	}
+
+	CHECK(tree_digest(reordered) == tree_digest(tree));
+	CHECK(tree_digest(FileTree()) != tree_digest(tree));
+
+	// Any field of an entry counts
+	FileTree touched{tree};
+	touched.mutable_files(0)->set_mtime(101);
+	CHECK(tree_digest(touched) != tree_digest(tree));
+
+	// A file and a directory of the same path differ
+	FileTree file;
+	FileTree directory;
+	add_file(file, "x", 0, 0);
+	add_directory(directory, "x");
+	CHECK(tree_digest(file) != tree_digest(directory));
+}
+
+void test_record_digest() {
+	JournalRecord record;
+
+	record.set_peer_id("00");
+	record.set_generation(1);
+	*record.mutable_tree() = base_tree();
+
+	// Records journaled without a digest get one computed
+	CHECK(record_digest(record) == tree_digest(base_tree()));
+
+	record.set_digest(tree_digest(changed_tree()));
+	CHECK(record_digest(record) == tree_digest(changed_tree()));
+}
+
+int main() {
+	test_round_trip();
+	test_unchanged();
+	test_from_empty();
+	test_digest();
+	test_record_digest();
+
+	return check_result();
+}